@@ -22,6 +22,7 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "ssp.h"
 
 #define DAC124S085_INPUT_REG_DATA_MASK 0x0FFF
 
@@ -41,6 +42,67 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 
 void dac124s085_init(void);
 __inline void dac124s085_dac(volatile const uint16_t *abcd);
-__inline void dac124s085_dac_chn_set(uint16_t reg, uint16_t val, bool update_outputs);
+
+/* The writes below are made from the timer interrupt, so they are inlined
+into it (and with it into RAM, see LASERSHARK_RAM_HOT_PATH) rather than
+called. */
+
+// Like dac124s085_dac(), but with the four values passed in registers.
+static __INLINE __attribute__((always_inline)) void dac124s085_dac_values(uint16_t a, uint16_t b, uint16_t c, uint16_t d) {
+    SSPDrainRx();
+    SSPSendC16Queued(DAC124S085_INPUT_REG_A | DAC124S085_OP_WRITE_NO_UPDATE | a); // A
+    SSPSendC16Queued(DAC124S085_INPUT_REG_B | DAC124S085_OP_WRITE_NO_UPDATE | b); // B
+    SSPSendC16Queued(DAC124S085_INPUT_REG_C | DAC124S085_OP_WRITE_NO_UPDATE | c); // C
+    SSPSendC16Queued(DAC124S085_INPUT_REG_D | DAC124S085_OP_WRITE_UPDATE_OUTPUTS | d); // D
+}
+
+/*
+ * Like dac124s085_dac(), but the four frames are already built from the
+ * DAC124S085_INPUT_REG_x and DAC124S085_OP_x bits.
+ */
+static __INLINE __attribute__((always_inline)) void dac124s085_dac_frames(volatile const uint16_t *frames) {
+    SSPDrainRx();
+    SSPSendC16Queued(frames[0]); // A
+    SSPSendC16Queued(frames[1]); // B
+    SSPSendC16Queued(frames[2]); // C
+    SSPSendC16Queued(frames[3]); // D
+}
+
+/*
+ * Writes A to C without updating the outputs, leaving that to a later frame
+ * such as the one dac124s085_dac_update() sends.
+ */
+static __INLINE __attribute__((always_inline)) void dac124s085_dac_preload_values(uint16_t a, uint16_t b, uint16_t c) {
+    SSPDrainRx();
+    SSPSendC16Queued(DAC124S085_INPUT_REG_A | DAC124S085_OP_WRITE_NO_UPDATE | a); // A
+    SSPSendC16Queued(DAC124S085_INPUT_REG_B | DAC124S085_OP_WRITE_NO_UPDATE | b); // B
+    SSPSendC16Queued(DAC124S085_INPUT_REG_C | DAC124S085_OP_WRITE_NO_UPDATE | c); // C
+}
+
+// Like dac124s085_dac_preload_values(), but sends the first three of four built frames.
+static __INLINE __attribute__((always_inline)) void dac124s085_dac_preload_frames(volatile const uint16_t *frames) {
+    SSPDrainRx();
+    SSPSendC16Queued(frames[0]); // A
+    SSPSendC16Queued(frames[1]); // B
+    SSPSendC16Queued(frames[2]); // C
+}
+
+/*
+ * Sends a single built frame, normally the one that writes D and updates the
+ * outputs after a preload. The outputs change once it has been shifted out.
+ */
+static __INLINE __attribute__((always_inline)) void dac124s085_dac_update(uint16_t frame) {
+    SSPSendC16Queued(frame);
+}
+
+static __INLINE __attribute__((always_inline)) void dac124s085_dac_chn_set(uint16_t reg, uint16_t val, bool update_outputs) {
+	if (reg != DAC124S085_INPUT_REG_A  && reg != DAC124S085_INPUT_REG_B && reg != DAC124S085_INPUT_REG_C && reg != DAC124S085_INPUT_REG_D)
+	{
+		return;
+	}
+	SSPDrainRx();
+    SSPSendC16Queued(reg | (update_outputs ? DAC124S085_OP_WRITE_UPDATE_OUTPUTS : DAC124S085_OP_WRITE_NO_UPDATE) | (DAC124S085_INPUT_REG_DATA_MASK & val)); // D
+}
+
 #endif
 
@@ -34,7 +34,8 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 #define LASERSHARK_CMD_OUTPUT_ENABLE 0x01
 #define LASERSHARK_CMD_OUTPUT_DISABLE 0x00
 
-// Set/get current ilda rate
+// Set/get current ilda rate. Getting it also returns the rate the sample clock
+// achieves, trim included, as 16.16 fixed point after the requested rate.
 #define LASERSHARK_CMD_SET_ILDA_RATE 0x82
 #define LASERSHARK_CMD_GET_ILDA_RATE 0x83
 
@@ -59,15 +60,164 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 // Get the number of samples the ring buffer is able to store
 #define LASERSHARK_CMD_GET_RINGBUFFER_SAMPLE_COUNT 0X89
 
-// Get the number of samples that are unfilled in the ring buffer
+// Get the number of samples that are unfilled in the ring buffer or, in frame
+// loop mode, in the frame being loaded (0 if none is).
 #define LASERSHARK_CMD_GET_RINGBUFFER_EMPTY_SAMPLE_COUNT 0X8A
 
 // Version Info
-#define LASERSHARK_FW_MAJOR_VERSION 2
+#define LASERSHARK_FW_MAJOR_VERSION 3
 #define LASERSHARK_FW_MINOR_VERSION 1
 #define LASERSHARK_CMD_GET_LASERSHARK_FW_MAJOR_VERSION 0X8B
 #define LASERSHARK_GMD_GET_LASERSHARK_FW_MINOR_VERSION 0X8C
 
+// Get the output statistics, as the 32 bit fields of struct lasershark_stats in order
+#define LASERSHARK_CMD_GET_STATS 0x8D
+// Reset the output statistics
+#define LASERSHARK_CMD_CLEAR_STATS 0x8E
+
+// Get the cycle counts of an interrupt handler (PROFILE_x point in the second
+// byte) and reset them all, in builds made with PROFILE_ENABLED; see profile.h
+#define LASERSHARK_CMD_GET_PROFILE 0x8F
+#define LASERSHARK_CMD_CLEAR_PROFILE 0x90
+
+// Get the ILDA clock's drift against the host's USB frames: the sample rate
+// error and the core clock's offset, as signed 32 bit parts per billion, then
+// the number of windows measured, and the trim applied, in signed parts per
+// billion faster. Negative drift means the device runs slow, so the ring
+// buffer fills.
+#define LASERSHARK_CMD_GET_CLOCK_DRIFT 0x91
+// Trim the ILDA clock by the measured drift (second byte 1) or not (0)
+#define LASERSHARK_CMD_SET_CLOCK_TRIM 0x92
+
+// Servo the ILDA clock to hold the ring buffer at a fill level (second byte 1)
+// or not (0), followed by the target fill in samples, the proportional gain in
+// parts per billion per sample off target and the integral gain in parts per
+// billion per sample off target per second, 32 bits each. Replaces the drift
+// trim, for hosts that send at their own pace rather than the device's.
+#define LASERSHARK_CMD_SET_SERVO 0x93
+// Get the servo settings as sent to LASERSHARK_CMD_SET_SERVO, then the trim applied in parts per billion
+#define LASERSHARK_CMD_GET_SERVO 0x94
+
+// Run several commands from one packet and get all their replies back in one,
+// from firmware major version 3. The second byte is the number of commands,
+// each following as a length byte and then the bytes of the command as it
+// would be sent alone. The reply's third byte is the number of replies, each
+// following as a length byte and the reply the command would have got alone.
+// The batch fails, with the replies so far, at a malformed command or a
+// reply that does not fit.
+#define LASERSHARK_CMD_BATCH 0x95
+#define LASERSHARK_BATCH_CMD_OFFSET 2
+#define LASERSHARK_BATCH_REPLY_OFFSET 3
+
+// Get the last sync marker the output reached (see LASERSHARK_CONTROL_SYNC),
+// the USB frame number it was reached in and how many have been reached.
+#define LASERSHARK_CMD_GET_SYNC 0x96
+
+// Get everything the single value queries above report about the device in
+// one reply, as a struct lasershark_device_info, from firmware version 3.1.
+// Fields are only ever added at the end, with info_version raised.
+#define LASERSHARK_CMD_GET_DEVICE_INFO 0x97
+#define LASERSHARK_DEVICE_INFO_VERSION 1
+// Bits of lasershark_device_info.features
+#define LASERSHARK_FEATURE_BATCH 0x01 // LASERSHARK_CMD_BATCH
+#define LASERSHARK_FEATURE_CONTROL 0x02 // Control words in the sample stream
+#define LASERSHARK_FEATURE_STATUS_EP 0x04 // Status records pushed on endpoint 2
+#define LASERSHARK_FEATURE_DATA_NAK 0x08 // See LASERSHARK_USB_DATA_NAK
+#define LASERSHARK_FEATURE_DAC_TIMED_UPDATE 0x10 // See LASERSHARK_DAC_TIMED_UPDATE
+#define LASERSHARK_FEATURE_PROFILE 0x20 // LASERSHARK_CMD_GET_PROFILE
+#define LASERSHARK_FEATURE_COMPRESSED 0x40 // LASERSHARK_DATA_COMPRESSED
+#define LASERSHARK_FEATURE_FRAME_LOOP 0x80 // LASERSHARK_CMD_FRAME_LOAD
+#define LASERSHARK_FEATURE_LINES 0x100 // LASERSHARK_PACK_LINE
+#define LASERSHARK_FEATURE_TRANSFORM 0x200 // LASERSHARK_CMD_SET_TRANSFORM
+#define LASERSHARK_FEATURE_WARP 0x400 // LASERSHARK_CMD_SET_WARP
+#define LASERSHARK_FEATURE_GAMMA 0x800 // LASERSHARK_CMD_SET_GAMMA
+#define LASERSHARK_FEATURE_DELAY 0x1000 // LASERSHARK_CMD_SET_DELAY
+// Get the output's state in one reply, as a struct lasershark_runtime_state.
+#define LASERSHARK_CMD_GET_RUNTIME_STATE 0x98
+
+// Set how data packets on endpoints 3 and 4 are encoded (second byte) and get
+// it back. Setting it starts the compressed stream's previous sample afresh,
+// centred and dark, with the line step and repeats at their defaults.
+#define LASERSHARK_CMD_SET_DATA_FORMAT 0x99
+#define LASERSHARK_CMD_GET_DATA_FORMAT 0x9A
+#define LASERSHARK_DATA_RAW 0x00 // 8 bytes a sample, as always
+#define LASERSHARK_DATA_COMPRESSED 0x01 // The ops below
+
+// Frame loop mode: the ring buffer is split into two frame buffers of
+// LASERSHARK_FRAME_SAMPLES, and the output plays the front one over and over
+// while data packets load the back one, so static content needs no streaming
+// and outlives a stalled host. Control words in a frame are dropped.
+// Start loading a frame into the back buffer, entering frame loop mode if not
+// in it already; unplayed streamed samples are dropped and the output is dark
+// until the first frame is swapped in. Fails while a swap is pending.
+#define LASERSHARK_CMD_FRAME_LOAD 0x9B
+// End loading the frame and make it the front one once the current pass over
+// the front one ends, or straight away if there is none. Data packets are
+// dropped until the next LASERSHARK_CMD_FRAME_LOAD. Fails if it is empty.
+#define LASERSHARK_CMD_FRAME_SWAP 0x9C
+// Leave frame loop mode and go back to streaming into an empty ring buffer.
+#define LASERSHARK_CMD_FRAME_STOP 0x9D
+// Get whether in frame loop mode, whether a swap is pending, the samples in
+// the front and back frames, 16 bits each, and the passes played, 32 bits.
+#define LASERSHARK_CMD_GET_FRAME 0x9E
+
+// Set the transform X and Y go through as samples are received, for size,
+// position, rotation and keystone: a 3x3 matrix of signed 16.16 fixed point
+// numbers, row by row, 32 bits each. A point is taken relative to
+// DAC124S085_DAC_VAL_MID and multiplied as the column (X, Y, 1), the result's
+// first two elements are divided by its third and the point is clamped to the
+// DAC range. Samples already received, a frame being looped among them, keep
+// the transform they had. Fails unless the third element is positive for the
+// middle point. Get it back in the same form.
+#define LASERSHARK_CMD_SET_TRANSFORM 0x9F
+#define LASERSHARK_CMD_GET_TRANSFORM 0xA0
+#define LASERSHARK_TRANSFORM_SIZE 9
+#define LASERSHARK_TRANSFORM_ONE 0x10000
+
+// Warp correction, for the pincushion and dome distortion no matrix undoes:
+// a mesh of N by N points spread evenly from 0 to 4096 on each axis, each
+// with an X and a Y offset in DAC steps. After the transform a point is moved
+// by the offsets at the corners of the mesh cell it is in, interpolated
+// bilinearly, and clamped to the DAC range again.
+// Set count mesh points from first, counting row by row with N a row: bytes
+// 1 and 2 are first and count, at most LASERSHARK_WARP_POINTS_PER_CMD, then
+// come each point's X and Y offsets, 16 bits each and within +/-4095. This
+// turns the warp off, so that no sample sees a part written mesh.
+#define LASERSHARK_CMD_SET_WARP 0xA1
+// Turn the warp on with the mesh set and N (second byte) 2, 3, 5 or 9, or off with 0.
+#define LASERSHARK_CMD_WARP_ENABLE 0xA2
+// Get N, 0 if the warp is off, and then mesh points asked for as they are set.
+#define LASERSHARK_CMD_GET_WARP 0xA3
+#define LASERSHARK_WARP_SIZE_MAX 9
+#define LASERSHARK_WARP_POINTS_PER_CMD 15
+
+// Set the curve A (second byte 0) or B (1) goes through as samples are
+// received, for diode gamma and intensity calibration: the values it maps 0,
+// 256, 512 and so on up to 4096 to, 16 bits each and at most
+// DAC124S085_DAC_VAL_MAX, with values between them interpolated linearly.
+// The curve is replaced as a whole between two data packets, and samples
+// already received keep the curve they had. A LASERSHARK_PACK_MOVE stays at
+// 0 whatever the curve maps 0 to. A straight curve, the one set at start
+// up with point i at i * 256 (4095 at the top), leaves its channel exactly as
+// sent. Get it back in the same form.
+#define LASERSHARK_CMD_SET_GAMMA 0xA4
+#define LASERSHARK_CMD_GET_GAMMA 0xA5
+#define LASERSHARK_GAMMA_CHANNELS 2
+#define LASERSHARK_GAMMA_SHIFT 8
+#define LASERSHARK_GAMMA_POINTS ((1 << (12 - LASERSHARK_GAMMA_SHIFT)) + 1)
+
+// Set how many samples A, B, C and INTL_A (second to fifth bytes) lag X and
+// Y by, at most LASERSHARK_DELAY_MAX each, so that colour changes land where
+// the slower galvos have got to. Each sample's position goes out with the
+// colour of the sample that many before it, which is dark just after the
+// output starts or the ring buffer runs dry; a looped frame takes it from its
+// own end. The samples the largest delay reaches back over are kept from
+// being written, so the empty sample count drops by that much. Get them back
+// in the same form.
+#define LASERSHARK_CMD_SET_DELAY 0xA6
+#define LASERSHARK_CMD_GET_DELAY 0xA7
+#define LASERSHARK_DELAY_MAX 32
+
 
 #define LASERSHARK_X_DAC_REG DAC124S085_INPUT_REG_C
 #define LASERSHARK_Y_DAC_REG DAC124S085_INPUT_REG_D
@@ -85,6 +235,10 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 #define LASERSHARK_INTL_B_PORT 1
 #define LASERSHARK_INTL_B_PIN 0
 
+// INTL_A and C are set together through the masked port register.
+#define LASERSHARK_PINS_PORT LASERSHARK_C_PORT
+#define LASERSHARK_PINS_MASK ((1 << LASERSHARK_C_PIN) | (1 << LASERSHARK_INTL_A_PIN))
+
 
 #define LASERSHARK_PGM_BUTTON_PORT 0
 #define LASERSHARK_PGM_BUTTON_PIN 1
@@ -93,28 +247,222 @@ along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
 #define LASERSHARK_USB_DATA_BULK_SIZE 64
 #define LASERSHARK_USB_DATA_ISO_SIZE 512
 #define LASERSHARK_USB_SOF_RATE 1000
+#define LASERSHARK_USB_STATUS_SIZE 32
+// Endpoint 2 pushes a struct lasershark_status every LASERSHARK_STATUS_FRAMES
+// USB frames, provided the host has collected the last one.
+#define LASERSHARK_STATUS_FRAMES 4
+
+// A sample whose X word has the top four bits, otherwise unused, all set is
+// not played but is a control word. The rest of the X word is one of the
+// operations below, and the first four bytes of the sample, most significant
+// first, are its argument. It takes effect when the output reaches it in the
+// stream, between the samples sent either side of it.
+#define LASERSHARK_CONTROL_MARK 0xF000
+#define LASERSHARK_CONTROL_RATE 0x001 // Argument: the new ILDA rate
+#define LASERSHARK_CONTROL_BLANK 0x002 // Argument: 1 to blank the samples that follow, 0 to stop
+#define LASERSHARK_CONTROL_SYNC 0x003 // Argument: a marker to read back with LASERSHARK_CMD_GET_SYNC
+// Control words sent but not yet reached, at most.
+#define LASERSHARK_CONTROL_QUEUE_SIZE 16
+
+// A LASERSHARK_DATA_COMPRESSED packet is a run of ops, each making samples
+// from the one before. Ops do not span packets but the previous sample
+// carries over from one packet to the next. The top two bits of an op's first
+// byte say which it is:
+//   00 DELTA       2 bytes: X and Y moved by 7 bit signed amounts, X first
+//   01 DELTA_LONG  3 bytes: the same with 11 bit amounts
+//   10 REPEAT      1 byte: the previous sample again, 1 to 64 times (low bits + 1)
+//   11 SAMPLE      a byte of 0xC0 and then a sample, or control word, as sent raw
+//      COLOUR      a byte of 0xC1 and then a sample's first four bytes, which
+//                  set A, B, C and INTL_A for the samples that follow
+//      LINE        a byte of 0xC2 and then a sample's last four bytes, a point
+//                  to draw a line to from the previous sample (see below)
+//      MOVE        a byte of 0xC3 and then a point as for LINE, to move to
+//                  with A and B at 0 but C and INTL_A as they are
+//      STEP        a byte of 0xC4, the most a line moves along X or Y from
+//                  one sample to the next, 16 bits and at least 1, and how
+//                  many times a line repeats its end point, 8 bits
+// X and Y wrap within 12 bits. Anything else ends the packet.
+// A line, or a move, is made on the device as the fewest evenly spaced samples
+// that step from the previous sample to its end point, that one included,
+// followed by its repeats, so a polyline is a run of LINEs after a MOVE.
+#define LASERSHARK_PACK_OP_MASK 0xC0
+#define LASERSHARK_PACK_DELTA 0x00
+#define LASERSHARK_PACK_DELTA_LONG 0x40
+#define LASERSHARK_PACK_REPEAT 0x80
+#define LASERSHARK_PACK_SAMPLE 0xC0
+#define LASERSHARK_PACK_COLOUR 0xC1
+#define LASERSHARK_PACK_LINE 0xC2
+#define LASERSHARK_PACK_MOVE 0xC3
+#define LASERSHARK_PACK_STEP 0xC4
+#define LASERSHARK_PACK_REPEAT_MAX 64
+// What LASERSHARK_CMD_SET_DATA_FORMAT sets the line step and repeats to.
+#define LASERSHARK_PACK_STEP_DEFAULT 64
+#define LASERSHARK_PACK_DWELL_DEFAULT 0
+// Most samples decoded from a bulk packet in one go, the rest being left for
+// a later USB interrupt; as many as a full isochronous packet holds raw.
+#define LASERSHARK_DECODE_SAMPLES_MAX 64
+
+// When set, a bulk data packet that does not fit in the ring buffer is left in
+// the endpoint buffer, so the host is NAKed until the timer interrupt has played
+// enough samples to make room for it, instead of unplayed samples being
+// overwritten.
+#define LASERSHARK_USB_DATA_NAK 1
+
+// When set, each sample's first three DAC channels are written ahead of its
+// tick and a single frame sent LASERSHARK_DAC_UPDATE_CLOCKS after the tick
+// updates the outputs, so when a point is drawn no longer depends on how late
+// the timer interrupt was entered. Samples come out one period later, and the
+// interrupt waits for the update time on every tick, so it is off by default.
+#ifndef LASERSHARK_DAC_TIMED_UPDATE
+#define LASERSHARK_DAC_TIMED_UPDATE 0
+#endif
+#define LASERSHARK_DAC_UPDATE_CLOCKS 96
+
+// When set, the timer interrupt that plays samples, with everything it
+// inlines, runs from main RAM rather than flash so its instruction fetches
+// see no flash wait states. It costs main RAM the size of the handler.
+#ifndef LASERSHARK_RAM_HOT_PATH
+#define LASERSHARK_RAM_HOT_PATH 0
+#endif
 extern unsigned char OUT1Packet[]; //User application buffer for receiving and holding OUT packets sent from the host
 extern unsigned char IN1Packet[]; //User application buffer for sending IN packets to the host
 
 int32_t lasershark_usb_data_packet_size;
 int32_t lasershark_usb_data_packet_samp_count;
 
-#define LASERSHARK_RINGBUFFER_SAMPLES 768
+#define LASERSHARK_RINGBUFFER_SAMPLES 1536
+#define LASERSHARK_FRAME_SAMPLES (LASERSHARK_RINGBUFFER_SAMPLES / 2)
 #define LASERSHARK_ILDA_CHANNELS 4
-volatile uint16_t lasershark_ringbuffer[LASERSHARK_RINGBUFFER_SAMPLES][LASERSHARK_ILDA_CHANNELS];
+/*
+ * The ring buffer keeps the 50 bits of a sample packed across four arrays,
+ * which together fill what main RAM gave a 768 sample buffer plus the
+ * otherwise unused SRAM1 and USB RAM:
+ *   xya     (main RAM) X in bits 0-11, Y in bits 12-23, A's top 8 bits above
+ *   b       (SRAM1)    B's top 8 bits
+ *   ab_low  (USB RAM)  A's bottom 4 bits, then B's bottom 4 bits
+ *   pins    (USB RAM)  C then INTL_A, two bits a sample, four samples a byte
+ * Ready-made DAC frames, at 8 bytes a sample, would need 12 KiB at this depth,
+ * which is every RAM block the part has. So the output interrupt unpacks each
+ * sample and adds the register bits itself, and data packets are read into
+ * a word aligned buffer and packed from there, since the ring no longer
+ * matches the layout they are sent in.
+ */
+extern volatile uint32_t lasershark_ringbuffer_xya[LASERSHARK_RINGBUFFER_SAMPLES];
+extern volatile uint8_t lasershark_ringbuffer_b[LASERSHARK_RINGBUFFER_SAMPLES];
+extern volatile uint8_t lasershark_ringbuffer_ab_low[LASERSHARK_RINGBUFFER_SAMPLES];
+extern volatile uint8_t lasershark_ringbuffer_pins[LASERSHARK_RINGBUFFER_SAMPLES / 4];
 volatile uint16_t lasershark_blankingbuffer[LASERSHARK_ILDA_CHANNELS];
 
 volatile uint32_t lasershark_ringbuffer_head;
 volatile uint32_t lasershark_ringbuffer_tail;
+// Free samples a held back data packet needs, 0 if none is held back.
+volatile uint32_t lasershark_ringbuffer_room_wanted;
+// Samples kept unwritten behind the head, see LASERSHARK_CMD_SET_DELAY.
+volatile uint32_t lasershark_ringbuffer_reserved;
 bool lasershark_ringbuffer_half_full_reporting;
+// Set in frame loop mode, see LASERSHARK_CMD_FRAME_LOAD.
+volatile bool lasershark_frame_mode;
+
+/*
+ * Output statistics since power up or the last LASERSHARK_CMD_CLEAR_STATS.
+ * Events are stamped with the 11 bit USB frame number they were last seen in.
+ */
+struct lasershark_stats {
+	uint32_t underrun_events; // Times the ring buffer ran dry while the output was enabled
+	uint32_t underrun_samples; // Sample periods the ring buffer was dry for
+	uint32_t underrun_frame;
+	uint32_t overrun_samples; // Samples dropped because the ring buffer was full
+	uint32_t overrun_frame;
+	uint32_t isr_latency_max; // Longest delay from a timer match to its interrupt, in core clocks
+	uint32_t low_water; // Fewest samples left to play once one was played
+	uint32_t control_dropped; // Control words that were invalid or did not fit in the queue
+	uint32_t decode_errors; // Compressed data packets cut short by a malformed op
+};
+volatile struct lasershark_stats lasershark_stats;
 
 
 #define LASERSHARK_ILDA_RATE_DEFAULT 1000
 uint32_t lasershark_ilda_rate_max;
 uint32_t lasershark_curr_ilda_rate;
+// A sample period is lasershark_core_duration + 1 core clocks plus
+// lasershark_core_duration_frac / 2^32 of one, the fraction being made up by
+// lengthening a period by a clock whenever it has added up to a whole one.
 uint32_t lasershark_core_duration;
+volatile uint32_t lasershark_core_duration_frac;
+// Core clocks in the sample periods played so far, wrapping.
+volatile uint32_t lasershark_core_clocks;
+
+// Drift of the ILDA clock against the host's USB frames, see LASERSHARK_CMD_GET_CLOCK_DRIFT.
+#define LASERSHARK_DRIFT_WINDOW_FRAMES 1024
+int32_t lasershark_drift_ppb;
+int32_t lasershark_crystal_ppb;
+uint32_t lasershark_drift_windows;
+bool lasershark_clock_trim;
+int32_t lasershark_trim_ppb;
+
+// Ring buffer fill servo, see LASERSHARK_CMD_SET_SERVO. It runs every LASERSHARK_SERVO_FRAMES USB frames.
+#define LASERSHARK_SERVO_FRAMES 16
+#define LASERSHARK_SERVO_TARGET_DEFAULT (LASERSHARK_RINGBUFFER_SAMPLES / 2)
+#define LASERSHARK_SERVO_KP_DEFAULT 10000
+#define LASERSHARK_SERVO_KI_DEFAULT 750
+// What endpoint 2 pushes, so that hosts need not poll EP1.
+struct lasershark_status {
+	uint16_t frame; // USB frame number it was taken in
+	uint16_t empty_samples; // As LASERSHARK_CMD_GET_RINGBUFFER_EMPTY_SAMPLE_COUNT
+	uint32_t underrun_events;
+	uint32_t overrun_samples;
+	int32_t drift_ppb;
+	int32_t trim_ppb;
+	uint32_t sync_count;
+	uint8_t output_enabled;
+	uint8_t interlock_b; // Level of the INTL_B input
+	uint8_t blank;
+	uint8_t reserved;
+};
+
+// The LASERSHARK_CMD_GET_DEVICE_INFO reply, after the command and status bytes.
+struct lasershark_device_info {
+	uint8_t info_version; // LASERSHARK_DEVICE_INFO_VERSION
+	uint8_t fw_major_version;
+	uint8_t fw_minor_version;
+	uint8_t samp_element_count;
+	uint32_t ilda_rate_max;
+	uint32_t ringbuffer_sample_count;
+	uint16_t packet_samp_count; // As LASERSHARK_CMD_GET_PACKET_SAMP_COUNT
+	uint16_t bulk_packet_samp_count;
+	uint16_t dac_min;
+	uint16_t dac_max;
+	uint16_t ctrl_size; // Largest command or reply on endpoint 1
+	uint16_t control_queue_size;
+	uint32_t core_clock; // Hz
+	uint32_t features;
+};
+
+// The LASERSHARK_CMD_GET_RUNTIME_STATE reply, after the command and status bytes.
+struct lasershark_runtime_state {
+	struct lasershark_status status;
+	uint32_t ilda_rate;
+	uint32_t achieved_ilda_rate; // 16.16 fixed point, as LASERSHARK_CMD_GET_ILDA_RATE
+	uint32_t sync_marker;
+	uint8_t servo;
+	uint8_t clock_trim;
+	uint8_t reserved[2];
+};
+
+// Set by LASERSHARK_CONTROL_BLANK. Cleared, like the queued control words, when
+// the output is disabled, runs dry or starts or stops frame loop mode.
+bool lasershark_blank;
+uint32_t lasershark_sync_marker;
+uint32_t lasershark_sync_frame;
+uint32_t lasershark_sync_count;
+
+bool lasershark_servo;
+uint32_t lasershark_servo_target;
+uint32_t lasershark_servo_kp;
+uint32_t lasershark_servo_ki;
 
 bool lasershark_output_enabled;
+uint32_t lasershark_data_format;
 
 void lasershark_init();
 
@@ -124,7 +472,13 @@ bool lasershark_set_ilda_rate(uint32_t ilda_rate);
 
 __inline uint32_t lasershark_get_empty_sample_count();
 
+void lasershark_usb_sof();
+
+void lasershark_clear_stats();
+void lasershark_get_status(struct lasershark_status *status);
+
 __inline void lasershark_process_data(unsigned char* packet, uint32_t cnt);
+uint32_t lasershark_decode_data(unsigned char *packet, uint32_t cnt, bool hold);
 
 void CT32B1_IRQHandler(void);
 
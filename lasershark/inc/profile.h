@@ -0,0 +1,60 @@
+/*
+profile.h - Lasershark firmware.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "LPC13Uxx.h"
+
+// Set to 1 to time the output and USB interrupt handlers with the DWT cycle
+// counter. The times are read back with LASERSHARK_CMD_GET_PROFILE.
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED 0
+#endif
+
+// What is timed.
+#define PROFILE_CT32B1_IRQ 0
+#define PROFILE_USB_IRQ 1
+#define PROFILE_USB_EP3 2
+#define PROFILE_POINTS 3
+
+// Histogram bucket n counts times below 64 << n cycles, the last one the rest.
+#define PROFILE_BUCKETS 8
+#define PROFILE_BUCKET0_SHIFT 6
+
+// Bytes profile_get() writes: count, min, max, mean and the buckets, 32 bits each.
+#define PROFILE_REPORT_SIZE ((4 + PROFILE_BUCKETS) * sizeof(uint32_t))
+
+#if (PROFILE_ENABLED)
+// Times are wall clock, so they include any interrupt that preempted the one timed.
+#define PROFILE_START(start) uint32_t start = DWT->CYCCNT
+#define PROFILE_END(point, start) profile_record(point, DWT->CYCCNT - (start))
+#else
+#define PROFILE_START(start)
+#define PROFILE_END(point, start)
+#endif
+
+void profile_init(void);
+void profile_clear(void);
+void profile_record(uint32_t point, uint32_t cycles);
+bool profile_get(uint32_t point, uint8_t *report);
+
+#endif /* PROFILE_H_ */
@@ -11,6 +11,8 @@
 #ifndef __SSP_H__
 #define __SSP_H__
 
+#include "LPC13Uxx.h"
+
 /* There are there modes in SSP: loopback, master or slave. */
 /* Here are the combination of all the tests. 
 (1) LOOPBACK test:		LOOPBACK_MODE=1, TX_RX_ONLY=0, USE_CS=1;
@@ -85,6 +87,31 @@
 #define RDSR_RDY	0x01
 #define RDSR_WEN	0x02
 
+/* SSPDrainRx() and SSPSendC16Queued() sit in the DAC path of the timer
+interrupt, so they are inlined rather than called. */
+
+/* Discard whatever the frames sent by SSPSendC16Queued() have left in the
+RxFIFO so far. Frames still being shifted out are picked up by the next call. */
+static __INLINE __attribute__((always_inline)) void SSPDrainRx( void )
+{
+	uint16_t Dummy = Dummy;
+
+	while ( LPC_SSP0->SR & SSPSR_RNE )
+	{
+		Dummy = LPC_SSP0->DR;
+	}
+}
+
+/* Put a 16 bit frame in the TxFIFO and return without waiting for it to be
+sent. Nothing is read back, so SSPDrainRx() must be called before more than
+FIFOSIZE frames are outstanding or the RxFIFO overruns. */
+static __INLINE __attribute__((always_inline)) void SSPSendC16Queued( uint16_t c )
+{
+	/* Only waits if the TX FIFO is full. */
+	while ( !(LPC_SSP0->SR & SSPSR_TNF) );
+	LPC_SSP0->DR = c;
+}
+
 /* If RX_INTERRUPT is enabled, the SSP RX will be handled in the ISR
 SSPReceive() will not be needed. */
 extern void SSP_IRQHandler (void);
@@ -4,5 +4,10 @@
 #define __usb_user_h__
 
 ErrorCode_t USB_InitUser(void);
+ErrorCode_t USB_SOF_Event(USBD_HANDLE_T hUsb);
+ErrorCode_t USB_Configure_Event(USBD_HANDLE_T hUsb);
+ErrorCode_t USB_Interface_Event(USBD_HANDLE_T hUsb);
+void USB_ResumeData(void);
+void USB_DropData(void);
 
 #endif
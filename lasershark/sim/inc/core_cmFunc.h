@@ -0,0 +1,59 @@
+/*
+core_cmFunc.h - Lasershark firmware host simulator.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Host replacement for the CMSIS core function access header. It shadows
+ * CMSISv2p00_LPC13xx/inc/core_cmFunc.h (sim/inc comes first on the include
+ * path) so the stock core_cm3.h and LPC13Uxx.h build on a Linux host.
+ * PRIMASK is routed to the simulated NVIC so that firmware critical sections
+ * hold off simulated interrupts exactly as they would on the part.
+ */
+
+#ifndef __CORE_CMFUNC_H
+#define __CORE_CMFUNC_H
+
+#include <stdint.h>
+
+extern volatile uint32_t sim_primask;
+
+static inline void __enable_irq(void) { sim_primask = 0; }
+static inline void __disable_irq(void) { sim_primask = 1; }
+static inline uint32_t __get_PRIMASK(void) { return sim_primask; }
+static inline void __set_PRIMASK(uint32_t priMask) { sim_primask = priMask & 1; }
+
+static inline void __enable_fault_irq(void) { }
+static inline void __disable_fault_irq(void) { }
+static inline uint32_t __get_CONTROL(void) { return 0; }
+static inline void __set_CONTROL(uint32_t control) { (void) control; }
+static inline uint32_t __get_IPSR(void) { return 0; }
+static inline uint32_t __get_APSR(void) { return 0; }
+static inline uint32_t __get_xPSR(void) { return 0; }
+static inline uint32_t __get_PSP(void) { return 0; }
+static inline void __set_PSP(uint32_t topOfProcStack) { (void) topOfProcStack; }
+static inline uint32_t __get_MSP(void) { return 0; }
+static inline void __set_MSP(uint32_t topOfMainStack) { (void) topOfMainStack; }
+static inline uint32_t __get_BASEPRI(void) { return 0; }
+static inline void __set_BASEPRI(uint32_t value) { (void) value; }
+static inline uint32_t __get_FAULTMASK(void) { return 0; }
+static inline void __set_FAULTMASK(uint32_t faultMask) { (void) faultMask; }
+static inline uint32_t __get_FPSCR(void) { return 0; }
+static inline void __set_FPSCR(uint32_t fpscr) { (void) fpscr; }
+
+#endif /* __CORE_CMFUNC_H */
@@ -0,0 +1,85 @@
+/*
+core_cmInstr.h - Lasershark firmware host simulator.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Host replacement for the CMSIS core instruction access header. Each
+ * intrinsic is implemented with portable C so core_cm3.h builds on a Linux
+ * host; barriers and hint instructions are no-ops.
+ */
+
+#ifndef __CORE_CMINSTR_H
+#define __CORE_CMINSTR_H
+
+#include <stdint.h>
+
+static inline void __NOP(void) { __asm__ volatile ("nop"); }
+static inline void __WFI(void) { }
+static inline void __WFE(void) { }
+static inline void __SEV(void) { }
+static inline void __ISB(void) { __asm__ volatile ("" ::: "memory"); }
+static inline void __DSB(void) { __asm__ volatile ("" ::: "memory"); }
+static inline void __DMB(void) { __asm__ volatile ("" ::: "memory"); }
+
+static inline uint32_t __REV(uint32_t value) { return __builtin_bswap32(value); }
+static inline uint32_t __REV16(uint32_t value)
+{
+	return ((value & 0xFF00FF00) >> 8) | ((value & 0x00FF00FF) << 8);
+}
+static inline int32_t __REVSH(int32_t value)
+{
+	return (int16_t) __builtin_bswap16((uint16_t) value);
+}
+static inline uint32_t __ROR(uint32_t op1, uint32_t op2)
+{
+	op2 &= 31;
+	return op2 ? (op1 >> op2) | (op1 << (32 - op2)) : op1;
+}
+#define __BKPT(value) __builtin_trap()
+
+static inline uint32_t __RBIT(uint32_t value)
+{
+	uint32_t result = 0;
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		result = (result << 1) | (value & 1);
+		value >>= 1;
+	}
+	return result;
+}
+
+static inline uint8_t __LDREXB(volatile uint8_t *addr) { return *addr; }
+static inline uint16_t __LDREXH(volatile uint16_t *addr) { return *addr; }
+static inline uint32_t __LDREXW(volatile uint32_t *addr) { return *addr; }
+static inline uint32_t __STREXB(uint8_t value, volatile uint8_t *addr) { *addr = value; return 0; }
+static inline uint32_t __STREXH(uint16_t value, volatile uint16_t *addr) { *addr = value; return 0; }
+static inline uint32_t __STREXW(uint32_t value, volatile uint32_t *addr) { *addr = value; return 0; }
+static inline void __CLREX(void) { }
+
+#define __SSAT(ARG1, ARG2) \
+	((int32_t) (ARG1) > ((1 << ((ARG2) - 1)) - 1) ? ((1 << ((ARG2) - 1)) - 1) : \
+	 (int32_t) (ARG1) < -(1 << ((ARG2) - 1)) ? -(1 << ((ARG2) - 1)) : (int32_t) (ARG1))
+#define __USAT(ARG1, ARG2) \
+	((int32_t) (ARG1) < 0 ? 0 : \
+	 (uint32_t) (ARG1) > ((1u << (ARG2)) - 1) ? ((1u << (ARG2)) - 1) : (uint32_t) (ARG1))
+
+static inline uint8_t __CLZ(uint32_t value) { return value ? __builtin_clz(value) : 32; }
+
+#endif /* __CORE_CMINSTR_H */
@@ -0,0 +1,15 @@
+/*
+ * Stand-in for the LPCXpresso header of the same name. The host has a single
+ * RAM, so the sections named here all end up in its .bss/.data. Functions
+ * meant for RAM are gathered in a section of their own, which the CPU model
+ * charges sim_ram_cpi16 per instruction for.
+ */
+
+#ifndef CR_SECTION_MACROS_H_
+#define CR_SECTION_MACROS_H_
+
+#define __DATA(bank) __attribute__((section(".data.$" #bank)))
+#define __BSS(bank) __attribute__((section(".bss.$" #bank)))
+#define __RAMFUNC(bank) __attribute__((section("sim_ramfunc")))
+
+#endif /* CR_SECTION_MACROS_H_ */
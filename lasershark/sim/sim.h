@@ -0,0 +1,118 @@
+/*
+sim.h - Lasershark firmware host simulator.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SIM_CORE_CLOCK 72000000
+#define SIM_CYCLES_PER_US (SIM_CORE_CLOCK / 1000000)
+#define SIM_NEVER UINT64_MAX
+
+// Cortex-M3 exception entry and return, in core cycles.
+#define SIM_EXC_ENTRY_CYCLES 12
+#define SIM_EXC_EXIT_CYCLES 10
+
+/* sim_cpu.c: virtual clock, MMIO trapping, instruction stepping and NVIC. */
+typedef uint32_t (*sim_read_fn)(uint32_t addr, bool side_effects);
+typedef void (*sim_write_fn)(uint32_t addr, uint32_t val);
+
+extern uint64_t sim_now; // Virtual core clock, in cycles since reset.
+extern uint32_t sim_cpi16; // Cycles charged per stepped instruction, in 1/16ths.
+extern uint32_t sim_ram_cpi16; // The same for instructions in __RAMFUNC functions.
+
+void sim_cpu_init(void);
+void sim_cpu_map(uint32_t base, uint32_t size);
+void sim_cpu_trap(uint32_t base, uint32_t size, uint32_t wait, sim_read_fn rd,
+		sim_write_fn wr);
+void sim_cpu_call(void(*fn)(void));
+void sim_cpu_advance(uint32_t cycles);
+int sim_cpu_rom_enter(uint32_t cycles);
+void sim_cpu_rom_exit(int depth);
+uint64_t sim_cpu_steps(void);
+
+void sim_irq_attach(int irqn, const char *name, void(*handler)(void));
+void sim_irq_line(int irqn, bool level);
+void sim_irq_dispatch(void);
+const char *sim_irq_name(int irqn);
+
+/* sim_periph.c: CT32B1, SSP0 with the DAC124S085 behind it, and GPIO. */
+void sim_periph_init(void);
+void sim_periph_sync(void);
+uint64_t sim_periph_next_event(void);
+void sim_periph_set_input(uint32_t port, uint32_t pin, bool level);
+uint32_t sim_periph_ssp_overruns(void);
+
+/* sim_usb.c: stand-in for the LPC13Uxx ROM USB device stack. */
+void sim_usb_init(int32_t ppm);
+void sim_usb_sync(void);
+uint64_t sim_usb_next_event(void);
+void sim_usb_host_out(uint32_t ep, const uint8_t *buf, uint32_t len);
+uint32_t sim_usb_host_pending(uint32_t ep);
+uint64_t sim_usb_bytes_read(uint32_t ep);
+uint64_t sim_usb_iso_lost(uint32_t ep);
+
+/* sim_host.c: synthetic host or replay of a recorded capture. */
+#define SIM_HOST_COMMANDS 8
+
+struct sim_host_cfg {
+	uint32_t rate; // ILDA rate the host asks for, in pps.
+	int32_t ppm; // Host clock error relative to the device crystal.
+	uint32_t ahead; // Samples queued before output is enabled.
+	uint32_t stall_period_ms; // Host stops sending every this many ms...
+	uint32_t stall_ms; // ...for this long. 0 disables stalls.
+	bool iso; // Stream on the isochronous endpoint 4 instead of bulk endpoint 3.
+	bool greedy; // Keep the bulk endpoint busy instead of pacing by the rate.
+	bool compressed; // Send samples as LASERSHARK_DATA_COMPRESSED.
+	uint32_t rate_to; // A LASERSHARK_CONTROL_RATE word in the stream changes the rate to this...
+	uint64_t rate_at; // ...before this sample, counting from the first sent. 0 for none.
+	const char *commands[SIM_HOST_COMMANDS]; // Hex EP1 commands sent once the rate is set.
+	uint32_t command_count;
+	const char *replay; // Capture to replay instead of the generator.
+	FILE *record; // Where to write the traffic that was sent, if anywhere.
+};
+
+void sim_host_init(const struct sim_host_cfg *cfg);
+void sim_host_run(void);
+uint64_t sim_host_next_event(void);
+void sim_host_in(uint32_t ep, const uint8_t *buf, uint32_t len);
+struct lasershark_status;
+const struct lasershark_status *sim_host_status(uint32_t *count);
+void sim_host_encode_sample(uint8_t *p, uint16_t a, uint16_t b, uint16_t x,
+		uint16_t y, bool intl_a, bool c);
+
+/* sim_main.c: scheduling, timeline and statistics. */
+void sim_poll(void);
+void sim_fatal(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
+void sim_log(uint64_t t, const char *event, const char *fmt, ...)
+		__attribute__((format(printf, 3, 4)));
+
+void sim_on_tick(uint64_t t);
+void sim_on_isr_enter(int irqn);
+void sim_on_isr_exit(int irqn, uint64_t pend, uint64_t entry, uint64_t exit);
+void sim_on_spi(uint64_t t, uint16_t word);
+void sim_on_dac(uint64_t t, const uint16_t out[4]);
+void sim_on_pin(uint64_t t, const char *name, bool level);
+void sim_on_usb(uint64_t t, uint32_t ep, uint32_t len);
+
+#endif /* SIM_H_ */
@@ -0,0 +1,417 @@
+/*
+sim_cpu.c - Lasershark firmware host simulator.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The firmware is compiled for the host unchanged, so LPC_CT32B1 and friends
+ * still point at the real peripheral addresses. Those pages are mapped here
+ * with no access rights: every register access faults, the fault is routed to
+ * a peripheral model, the page is opened for exactly one instruction (x86 trap
+ * flag) and then closed again. The same single-step trap is used to clock the
+ * virtual CPU while firmware code runs, which is what lets busy-wait loops on
+ * SSP status, ISR durations and interrupt preemption come out of the model
+ * instead of being guessed.
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include "LPC13Uxx.h"
+#include "sim.h"
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "The Lasershark simulator needs an x86-64 Linux host."
+#endif
+
+#define SIM_PAGE_SIZE 0x1000
+#define SIM_EFLAGS_TF 0x100
+#define SIM_MAX_TRAPS 16
+#define SIM_MAX_PENDING 4
+#define SIM_IRQS 32
+#define SIM_THREAD_PRIO 0x100
+
+#define SIM_NVIC_PAGE 0xE000E000
+#define SIM_NVIC_ISER 0xE000E100
+#define SIM_NVIC_ICER 0xE000E180
+#define SIM_NVIC_ISPR 0xE000E200
+#define SIM_NVIC_ICPR 0xE000E280
+#define SIM_NVIC_IABR 0xE000E300
+#define SIM_NVIC_IP 0xE000E400
+#define SIM_DWT_PAGE 0xE0001000
+
+struct sim_trap {
+	uint32_t base;
+	uint32_t size;
+	uint32_t wait;
+	sim_read_fn rd;
+	sim_write_fn wr;
+};
+
+struct sim_access {
+	struct sim_trap *trap;
+	uint32_t addr;
+	bool write;
+};
+
+struct sim_irq {
+	const char *name;
+	void(*handler)(void);
+	bool line;
+	uint64_t pend;
+};
+
+uint64_t sim_now;
+uint32_t sim_cpi16 = 16;
+uint32_t sim_ram_cpi16 = 16;
+volatile uint32_t sim_primask;
+
+static struct sim_trap traps[SIM_MAX_TRAPS];
+static int trap_count;
+static struct sim_access pending[SIM_MAX_PENDING];
+static int pending_count;
+static int trace_depth;
+static uint64_t steps;
+static uint32_t cpi_frac;
+static uint32_t call_overhead;
+
+// Bounds of the firmware's __RAMFUNC functions, if it has any.
+extern const char __start_sim_ramfunc[] __attribute__((weak));
+extern const char __stop_sim_ramfunc[] __attribute__((weak));
+
+static struct sim_irq irqs[SIM_IRQS];
+static uint32_t nvic_enabled;
+static uint32_t nvic_pending;
+static uint32_t nvic_active;
+static uint32_t nvic_ip[SIM_IRQS / 4];
+static uint32_t nvic_other[SIM_PAGE_SIZE / 4];
+static uint32_t dwt_ctrl;
+static uint64_t dwt_cyccnt_zero; // When CYCCNT was 0.
+static uint32_t cur_prio = SIM_THREAD_PRIO;
+
+static struct sim_trap *trap_find(uintptr_t addr) {
+	int i;
+
+	for (i = 0; i < trap_count; i++) {
+		if (addr >= traps[i].base && addr < traps[i].base + traps[i].size) {
+			return &traps[i];
+		}
+	}
+	return NULL;
+}
+
+static void page_protect(uint32_t addr, int prot) {
+	if (mprotect((void *) (uintptr_t) (addr & ~(SIM_PAGE_SIZE - 1)),
+			SIM_PAGE_SIZE, prot)) {
+		abort();
+	}
+}
+
+static void sim_segv(int sig, siginfo_t *si, void *ctx) {
+	ucontext_t *uc = ctx;
+	uintptr_t addr = (uintptr_t) si->si_addr;
+	struct sim_trap *trap = trap_find(addr);
+	struct sim_access *acc;
+
+	if (!trap || pending_count == SIM_MAX_PENDING) {
+		fprintf(stderr, "sim: fault at %#lx (rip %#llx) is not a modelled register\n",
+				(unsigned long) addr,
+				(unsigned long long) uc->uc_mcontext.gregs[REG_RIP]);
+		signal(SIGSEGV, SIG_DFL);
+		return;
+	}
+
+	acc = &pending[pending_count++];
+	acc->trap = trap;
+	acc->addr = addr & ~3;
+	acc->write = (uc->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+
+	// Present the current register value; a store may only replace part of the word.
+	page_protect(acc->addr, PROT_READ | PROT_WRITE);
+	*(volatile uint32_t *) (uintptr_t) acc->addr = trap->rd(acc->addr,
+			!acc->write);
+	sim_cpu_advance(trap->wait);
+
+	uc->uc_mcontext.gregs[REG_EFL] |= SIM_EFLAGS_TF;
+}
+
+static void sim_step(int sig, siginfo_t *si, void *ctx) {
+	ucontext_t *uc = ctx;
+	const char *rip;
+	uint32_t frac;
+	int i;
+
+	for (i = 0; i < pending_count; i++) {
+		struct sim_access *acc = &pending[i];
+		if (acc->write) {
+			acc->trap->wr(acc->addr,
+					*(volatile uint32_t *) (uintptr_t) acc->addr);
+		}
+		page_protect(acc->addr, PROT_NONE);
+	}
+	pending_count = 0;
+
+	if (!trace_depth) {
+		uc->uc_mcontext.gregs[REG_EFL] &= ~SIM_EFLAGS_TF;
+		return;
+	}
+
+	steps++;
+	rip = (const char *) uc->uc_mcontext.gregs[REG_RIP];
+	frac = cpi_frac + (rip >= __start_sim_ramfunc && rip < __stop_sim_ramfunc ?
+			sim_ram_cpi16 : sim_cpi16);
+	cpi_frac = frac % 16;
+	sim_cpu_advance(frac / 16);
+
+	sim_poll();
+}
+
+static __attribute__((noinline)) void trace_on(void) {
+	__asm__ volatile ("pushfq\n\torq $0x100, (%%rsp)\n\tpopfq" ::: "memory", "cc");
+}
+
+static __attribute__((noinline)) void trace_off(void) {
+	__asm__ volatile ("pushfq\n\tandq $-0x101, (%%rsp)\n\tpopfq" ::: "memory", "cc");
+}
+
+static void nop_fn(void) {
+}
+
+void sim_cpu_call(void(*fn)(void)) {
+	trace_depth++;
+	trace_on();
+	fn();
+	trace_off();
+	trace_depth--;
+}
+
+void sim_cpu_advance(uint32_t cycles) {
+	sim_now += cycles;
+}
+
+/*
+ * Host code standing in for the boot ROM is not stepped; it is charged a
+ * modelled cost instead. The time is spent a little at a time so that a
+ * higher priority interrupt still preempts the ROM close to when it would.
+ */
+int sim_cpu_rom_enter(uint32_t cycles) {
+	int depth = trace_depth;
+
+	if (depth) {
+		trace_off();
+	}
+	trace_depth = 0;
+	while (cycles) {
+		uint32_t n = cycles < 8 ? cycles : 8;
+
+		sim_cpu_advance(n);
+		cycles -= n;
+		sim_poll();
+	}
+	return depth;
+}
+
+void sim_cpu_rom_exit(int depth) {
+	trace_depth = depth;
+	if (depth) {
+		trace_on();
+	}
+}
+
+uint64_t sim_cpu_steps(void) {
+	return steps;
+}
+
+void sim_cpu_map(uint32_t base, uint32_t size) {
+	void *p = mmap((void *) (uintptr_t) base, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+	if (p != (void *) (uintptr_t) base) {
+		sim_fatal("cannot map %#x bytes at %#x", size, base);
+	}
+}
+
+void sim_cpu_trap(uint32_t base, uint32_t size, uint32_t wait, sim_read_fn rd,
+		sim_write_fn wr) {
+	struct sim_trap *trap;
+	uint32_t addr;
+
+	if (trap_count == SIM_MAX_TRAPS) {
+		sim_fatal("too many trapped regions");
+	}
+	trap = &traps[trap_count++];
+	trap->base = base;
+	trap->size = size;
+	trap->wait = wait;
+	trap->rd = rd;
+	trap->wr = wr;
+	for (addr = base; addr < base + size; addr += SIM_PAGE_SIZE) {
+		page_protect(addr, PROT_NONE);
+	}
+}
+
+static uint32_t irq_prio(int irqn) {
+	return ((nvic_ip[irqn / 4] >> (8 * (irqn % 4))) & 0xFF) >> (8
+			- __NVIC_PRIO_BITS);
+}
+
+static uint32_t nvic_read(uint32_t addr, bool side_effects) {
+	if (addr == SIM_NVIC_ISER || addr == SIM_NVIC_ICER) {
+		return nvic_enabled;
+	}
+	if (addr == SIM_NVIC_ISPR || addr == SIM_NVIC_ICPR) {
+		return nvic_pending;
+	}
+	if (addr == SIM_NVIC_IABR) {
+		return nvic_active;
+	}
+	if (addr >= SIM_NVIC_IP && addr < SIM_NVIC_IP + sizeof(nvic_ip)) {
+		return nvic_ip[(addr - SIM_NVIC_IP) / 4];
+	}
+	return nvic_other[(addr - SIM_NVIC_PAGE) / 4];
+}
+
+static void nvic_write(uint32_t addr, uint32_t val) {
+	if (addr == SIM_NVIC_ISER) {
+		nvic_enabled |= val;
+	} else if (addr == SIM_NVIC_ICER) {
+		nvic_enabled &= ~val;
+	} else if (addr == SIM_NVIC_ISPR) {
+		nvic_pending |= val;
+	} else if (addr == SIM_NVIC_ICPR) {
+		nvic_pending &= ~val;
+	} else if (addr >= SIM_NVIC_IP && addr < SIM_NVIC_IP + sizeof(nvic_ip)) {
+		nvic_ip[(addr - SIM_NVIC_IP) / 4] = val;
+	} else if (addr != SIM_NVIC_IABR) {
+		nvic_other[(addr - SIM_NVIC_PAGE) / 4] = val;
+	}
+}
+
+// Only the DWT cycle counter is modelled; it counts virtual core clocks.
+static uint32_t dwt_read(uint32_t addr, bool side_effects) {
+	if (addr == (uint32_t) (uintptr_t) &DWT->CTRL) {
+		return dwt_ctrl;
+	}
+	if (addr == (uint32_t) (uintptr_t) &DWT->CYCCNT) {
+		return dwt_ctrl & DWT_CTRL_CYCCNTENA_Msk ? (uint32_t) (sim_now
+				- dwt_cyccnt_zero) : 0;
+	}
+	return 0;
+}
+
+static void dwt_write(uint32_t addr, uint32_t val) {
+	if (addr == (uint32_t) (uintptr_t) &DWT->CTRL) {
+		dwt_ctrl = val;
+	} else if (addr == (uint32_t) (uintptr_t) &DWT->CYCCNT) {
+		dwt_cyccnt_zero = sim_now - val;
+	}
+}
+
+void sim_irq_attach(int irqn, const char *name, void(*handler)(void)) {
+	irqs[irqn].name = name;
+	irqs[irqn].handler = handler;
+}
+
+const char *sim_irq_name(int irqn) {
+	return irqs[irqn].name ? irqs[irqn].name : "?";
+}
+
+void sim_irq_line(int irqn, bool level) {
+	if (level && !irqs[irqn].line && !(nvic_pending & (1u << irqn))) {
+		nvic_pending |= 1u << irqn;
+		irqs[irqn].pend = sim_now;
+	}
+	irqs[irqn].line = level;
+}
+
+/*
+ * Take every interrupt that may preempt what is running now, highest
+ * priority first. Called from the step trap, so a CT32B1 match preempts the
+ * USB handler at the instruction where it would on the part.
+ */
+void sim_irq_dispatch(void) {
+	while (!sim_primask) {
+		int irqn, best = -1;
+		uint32_t best_prio = cur_prio, saved_prio;
+		uint64_t entry, pend;
+
+		for (irqn = 0; irqn < SIM_IRQS; irqn++) {
+			if ((nvic_enabled & nvic_pending & (1u << irqn)) && irq_prio(irqn)
+					< best_prio) {
+				best = irqn;
+				best_prio = irq_prio(irqn);
+			}
+		}
+		if (best < 0) {
+			return;
+		}
+		if (!irqs[best].handler) {
+			sim_fatal("%s interrupt taken with no handler; the part would spin "
+					"in IntDefaultHandler", sim_irq_name(best));
+		}
+
+		nvic_pending &= ~(1u << best);
+		nvic_active |= 1u << best;
+		pend = irqs[best].pend; // The handler may pend it again
+		saved_prio = cur_prio;
+		cur_prio = best_prio;
+		// The few instructions sim_cpu_call() steps itself stand in for part of the stacking cost.
+		sim_cpu_advance(call_overhead < SIM_EXC_ENTRY_CYCLES ? SIM_EXC_ENTRY_CYCLES
+				- call_overhead : 0);
+		entry = sim_now;
+		sim_on_isr_enter(best);
+		sim_cpu_call(irqs[best].handler);
+		sim_on_isr_exit(best, pend, entry, sim_now);
+		sim_cpu_advance(SIM_EXC_EXIT_CYCLES);
+		cur_prio = saved_prio;
+		nvic_active &= ~(1u << best);
+
+		// Level sensitive: a source that is still asserted pends again.
+		if (irqs[best].line) {
+			nvic_pending |= 1u << best;
+			irqs[best].pend = sim_now;
+		}
+	}
+}
+
+void sim_cpu_init(void) {
+	struct sigaction sa;
+	uint64_t t0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sa.sa_sigaction = sim_segv;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = sim_step;
+	sigaction(SIGTRAP, &sa, NULL);
+
+	// System control space: NVIC, SysTick, SCB, and the DWT.
+	sim_cpu_map(SIM_NVIC_PAGE, SIM_PAGE_SIZE);
+	sim_cpu_trap(SIM_NVIC_PAGE, SIM_PAGE_SIZE, 0, nvic_read, nvic_write);
+	sim_cpu_map(SIM_DWT_PAGE, SIM_PAGE_SIZE);
+	sim_cpu_trap(SIM_DWT_PAGE, SIM_PAGE_SIZE, 0, dwt_read, dwt_write);
+
+	t0 = sim_now;
+	sim_cpu_call(nop_fn);
+	call_overhead = sim_now - t0;
+	sim_now = t0;
+	steps = 0;
+}
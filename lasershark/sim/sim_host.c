@@ -0,0 +1,506 @@
+/*
+sim_host.c - Lasershark firmware host simulator.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The USB host side. By default a generator plays the part of a host
+ * application: it sets the ILDA rate, sends the commands given with -x, queues
+ * some samples, enables output and then streams a circle at the requested
+ * rate from its own (possibly skewed) clock, optionally stalling now and then.
+ * Samples go to the bulk endpoint 3 with a few packets kept in flight, or with
+ * -i to the isochronous endpoint 4 as one packet a frame holding what the
+ * device plays in a frame. With -n the bulk host does not pace itself at all
+ * and relies on being NAKed. With -z the samples are sent compressed
+ * (LASERSHARK_DATA_COMPRESSED), as many as fit in a packet. With -R a
+ * LASERSHARK_CONTROL_RATE word goes in the stream before the given sample, and
+ * the host paces what follows it at the new rate. Alternatively a
+ * capture made with
+ * -w is replayed. Captures are text, one packet per line:
+ *
+ *   <time in us> <endpoint> <payload as hex>
+ *
+ * and lines starting with '#' are ignored.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lasershark.h"
+#include "sim.h"
+
+#define SIM_HOST_START_CYCLES (100 * SIM_CYCLES_PER_US)
+#define SIM_HOST_CIRCLE_POINTS 100
+#define SIM_HOST_SAMPLE_BYTES 8
+#define SIM_HOST_PACKET_BYTES 64
+#define SIM_HOST_ISO_BYTES LASERSHARK_USB_DATA_ISO_SIZE
+#define SIM_HOST_FRAME_CYCLES (SIM_CORE_CLOCK / 1000)
+// Packets the host keeps in flight, as a driver with a few URBs queued would.
+#define SIM_HOST_IN_FLIGHT 4
+
+enum host_state {
+	HOST_SET_RATE, HOST_WAIT_RATE, HOST_FORMAT, HOST_WAIT_FORMAT, HOST_COMMAND, HOST_WAIT_COMMAND, HOST_PREFILL, HOST_ENABLE, HOST_WAIT_ENABLE,
+	HOST_STREAM, HOST_REPLAY, HOST_DONE
+};
+
+static struct sim_host_cfg cfg;
+static enum host_state state;
+static uint64_t stream_start;
+static uint64_t samples_sent;
+static uint32_t circle_pos;
+static uint32_t commands_sent;
+// Samples the last data packet carried, and for -z the last sample packed.
+static uint32_t packet_samples = SIM_HOST_PACKET_BYTES / SIM_HOST_SAMPLE_BYTES;
+static uint8_t packed_last[SIM_HOST_SAMPLE_BYTES];
+// Whether the -R control word has gone out.
+static bool rate_sent;
+
+static FILE *replay;
+static struct {
+	uint64_t t;
+	uint32_t ep, len;
+	uint8_t data[512];
+	bool valid;
+} pending;
+
+static void send(uint32_t ep, const uint8_t *buf, uint32_t len) {
+	uint32_t i;
+
+	if (cfg.record) {
+		fprintf(cfg.record, "%.3f %u ", (double) sim_now / SIM_CYCLES_PER_US, ep);
+		for (i = 0; i < len; i++) {
+			fprintf(cfg.record, "%02x", buf[i]);
+		}
+		fputc('\n', cfg.record);
+	}
+	sim_usb_host_out(ep, buf, len);
+}
+
+static void send_command(uint8_t cmd, uint32_t arg) {
+	uint8_t buf[LASERSHARK_USB_CTRL_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = cmd;
+	if (cmd == LASERSHARK_CMD_SET_ILDA_RATE) {
+		memcpy(buf + 1, &arg, sizeof(arg));
+	} else {
+		buf[1] = arg;
+	}
+	send(1, buf, sizeof(buf));
+}
+
+/*
+ * Lay a sample out the way lasershark_process_data() picks it apart: the
+ * packet is read as big endian 32 bit words, so each pair of channels comes
+ * out swapped.
+ */
+void sim_host_encode_sample(uint8_t *p, uint16_t a, uint16_t b, uint16_t x,
+		uint16_t y, bool intl_a, bool c) {
+	a |= (intl_a ? LASERSHARK_INTL_A_BITMASK : 0) | (c ? LASERSHARK_C_BITMASK
+			: 0);
+	p[0] = b >> 8;
+	p[1] = b;
+	p[2] = a >> 8;
+	p[3] = a;
+	p[4] = y >> 8;
+	p[5] = y;
+	p[6] = x >> 8;
+	p[7] = x;
+}
+
+// Sends a -x command, given as hex bytes.
+static void send_hex_command(const char *hex) {
+	uint8_t buf[LASERSHARK_USB_CTRL_SIZE];
+	uint32_t i;
+
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < sizeof(buf) && isxdigit((unsigned char) hex[0])
+			&& isxdigit((unsigned char) hex[1]); i++, hex += 2) {
+		char byte[3] = { hex[0], hex[1], 0 };
+		buf[i] = strtoul(byte, NULL, 16);
+	}
+	if (*hex) {
+		sim_fatal("bad command %s", hex);
+	}
+	send(1, buf, sizeof(buf));
+}
+
+static void circle_sample(uint8_t *p) {
+	double angle = 2 * M_PI * circle_pos / SIM_HOST_CIRCLE_POINTS;
+	bool on = circle_pos % 4 != 3;
+
+	sim_host_encode_sample(p, on ? 4095 : 0, on ? 2048 : 0,
+			2048 + (int) lround(1800 * cos(angle)),
+			2048 + (int) lround(1800 * sin(angle)), true,
+			circle_pos < SIM_HOST_CIRCLE_POINTS / 2);
+	circle_pos = (circle_pos + 1) % SIM_HOST_CIRCLE_POINTS;
+}
+
+// Lays the -R control word out as a sample, its argument where A and B go.
+static void rate_control(uint8_t *p) {
+	sim_host_encode_sample(p, cfg.rate_to, cfg.rate_to >> 16,
+			LASERSHARK_CONTROL_MARK | LASERSHARK_CONTROL_RATE, 0, false, false);
+}
+
+static int32_t wrap12(int32_t d) {
+	return (int32_t) ((uint32_t) d << 20) >> 20;
+}
+
+/*
+ * Appends the ops that make sample p from the one packed before it to the len
+ * bytes in buf, merging a repeat into the one at *repeat if there is one, and
+ * returns the new length, or 0 if they do not fit in size bytes.
+ */
+static uint32_t pack_sample(uint8_t *buf, uint32_t len, uint32_t size,
+		const uint8_t *p, int32_t *repeat) {
+	int32_t dx = wrap12((p[6] << 8 | p[7]) - (packed_last[6] << 8 | packed_last[7]));
+	int32_t dy = wrap12((p[4] << 8 | p[5]) - (packed_last[4] << 8 | packed_last[5]));
+	bool colour = memcmp(p, packed_last, 4) != 0;
+	uint32_t need;
+
+	if (!colour && !dx && !dy) {
+		if (*repeat >= 0 && (buf[*repeat] & ~LASERSHARK_PACK_OP_MASK)
+				< LASERSHARK_PACK_REPEAT_MAX - 1) {
+			buf[*repeat]++;
+			return len;
+		}
+		if (len + 1 > size) {
+			return 0;
+		}
+		*repeat = len;
+		buf[len] = LASERSHARK_PACK_REPEAT;
+		return len + 1;
+	}
+	need = dx >= -64 && dx < 64 && dy >= -64 && dy < 64 ? 2 : dx >= -1024
+			&& dx < 1024 && dy >= -1024 && dy < 1024 ? 3 : 9;
+	if (colour && need != 9) {
+		need += 5;
+	}
+	if (len + need > size) {
+		return 0;
+	}
+	*repeat = -1;
+	if (need >= 9) {
+		buf[len++] = LASERSHARK_PACK_SAMPLE;
+		memcpy(buf + len, p, SIM_HOST_SAMPLE_BYTES);
+		memcpy(packed_last, p, SIM_HOST_SAMPLE_BYTES);
+		return len + SIM_HOST_SAMPLE_BYTES;
+	}
+	if (colour) {
+		buf[len++] = LASERSHARK_PACK_COLOUR;
+		memcpy(buf + len, p, 4);
+		len += 4;
+		need -= 5;
+	}
+	if (need == 2) {
+		buf[len++] = LASERSHARK_PACK_DELTA | (dx >> 1 & 0x3F);
+		buf[len++] = (dx & 1) << 7 | (dy & 0x7F);
+	} else {
+		buf[len++] = LASERSHARK_PACK_DELTA_LONG | (dx >> 5 & 0x3F);
+		buf[len++] = (dx & 0x1F) << 3 | (dy >> 8 & 0x07);
+		buf[len++] = dy;
+	}
+	memcpy(packed_last, p, SIM_HOST_SAMPLE_BYTES);
+	return len;
+}
+
+// Sends up to count samples, as many as fit in a packet of at most size bytes.
+static void send_samples(uint32_t ep, uint32_t count, uint32_t size) {
+	uint8_t buf[SIM_HOST_ISO_BYTES], sample[SIM_HOST_SAMPLE_BYTES];
+	uint32_t n, len = 0, packed, pos;
+	int32_t repeat = -1;
+
+	for (n = 0; n < count; n++) {
+		if (cfg.rate_at && !rate_sent && samples_sent + n == cfg.rate_at) {
+			if (len + (cfg.compressed ? 1 : 0) + SIM_HOST_SAMPLE_BYTES > size) {
+				break;
+			}
+			if (cfg.compressed) {
+				buf[len++] = LASERSHARK_PACK_SAMPLE;
+				repeat = -1;
+			}
+			rate_control(buf + len);
+			len += SIM_HOST_SAMPLE_BYTES;
+			rate_sent = true;
+		}
+		if (!cfg.compressed) {
+			if (len + SIM_HOST_SAMPLE_BYTES > size) {
+				break;
+			}
+			circle_sample(buf + len);
+			len += SIM_HOST_SAMPLE_BYTES;
+			continue;
+		}
+		pos = circle_pos;
+		circle_sample(sample);
+		packed = pack_sample(buf, len, size, sample, &repeat);
+		if (!packed) {
+			circle_pos = pos; // It goes in the next packet
+			break;
+		}
+		len = packed;
+	}
+	send(ep, buf, len);
+	samples_sent += n;
+	packet_samples = n;
+}
+
+// Sends a bulk packet of up to count samples.
+static void send_packet(uint32_t count) {
+	send_samples(3, count, SIM_HOST_PACKET_BYTES);
+}
+
+/*
+ * Samples the device has played t cycles after output was enabled, by the
+ * host's clock and allowing for the -R rate change.
+ */
+static uint64_t host_played(uint64_t t) {
+	double host_rate = cfg.rate * (1.0 + cfg.ppm / 1e6);
+	double played = t * host_rate / SIM_CORE_CLOCK;
+
+	if (cfg.rate_at && played > cfg.rate_at) {
+		played = cfg.rate_at + (t - cfg.rate_at * SIM_CORE_CLOCK / host_rate)
+				* cfg.rate_to * (1.0 + cfg.ppm / 1e6) / SIM_CORE_CLOCK;
+	}
+	return (uint64_t) played;
+}
+
+// How many cycles after output was enabled host_played() reaches n.
+static uint64_t host_played_by(uint64_t n) {
+	double host_rate = cfg.rate * (1.0 + cfg.ppm / 1e6);
+
+	if (cfg.rate_at && n > cfg.rate_at) {
+		return (uint64_t) ceil(cfg.rate_at * (double) SIM_CORE_CLOCK / host_rate
+				+ (n - cfg.rate_at) * (double) SIM_CORE_CLOCK / (cfg.rate_to
+						* (1.0 + cfg.ppm / 1e6)));
+	}
+	return (uint64_t) ceil(n * (double) SIM_CORE_CLOCK / host_rate);
+}
+
+/*
+ * An isochronous packet is sized so that, by the host's clock, the device
+ * will hold what was queued ahead once the coming frame has been played.
+ */
+static void send_iso_packet(void) {
+	uint64_t target = cfg.ahead + host_played(sim_now - stream_start
+			+ SIM_HOST_FRAME_CYCLES);
+	uint64_t count = target > samples_sent ? target - samples_sent : 0;
+
+	send_samples(4, count, SIM_HOST_ISO_BYTES);
+}
+
+static bool stalled(uint64_t t) {
+	uint64_t period = (uint64_t) cfg.stall_period_ms * 1000 * SIM_CYCLES_PER_US;
+	uint64_t stall = (uint64_t) cfg.stall_ms * 1000 * SIM_CYCLES_PER_US;
+
+	return cfg.stall_ms && period && t > stream_start && (t - stream_start)
+			% period >= period - stall;
+}
+
+// When, by the host's clock, the next packet of samples is due.
+static uint64_t stream_due(void) {
+	if (cfg.greedy) {
+		return sim_now;
+	}
+
+	uint64_t n = samples_sent + packet_samples - cfg.ahead;
+
+	return stream_start + host_played_by(n);
+}
+
+static bool replay_load(void) {
+	char line[2048], *p;
+	uint32_t i;
+
+	while (fgets(line, sizeof(line), replay)) {
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		pending.t = (uint64_t) (strtod(line, &p) * SIM_CYCLES_PER_US);
+		pending.ep = strtoul(p, &p, 10);
+		while (*p == ' ') {
+			p++;
+		}
+		for (i = 0; i < sizeof(pending.data) && isxdigit((unsigned char) p[0])
+				&& isxdigit((unsigned char) p[1]); i++, p += 2) {
+			char hex[3] = { p[0], p[1], 0 };
+			pending.data[i] = strtoul(hex, NULL, 16);
+		}
+		pending.len = i;
+		pending.valid = true;
+		return true;
+	}
+	pending.valid = false;
+	return false;
+}
+
+void sim_host_init(const struct sim_host_cfg *c) {
+	cfg = *c;
+	if (cfg.replay) {
+		replay = fopen(cfg.replay, "r");
+		if (!replay) {
+			sim_fatal("cannot open %s", cfg.replay);
+		}
+		state = HOST_REPLAY;
+		replay_load();
+	} else {
+		state = HOST_SET_RATE;
+	}
+	if (cfg.record) {
+		fprintf(cfg.record, "# lasershark-sim capture: time_us endpoint payload\n");
+	}
+}
+
+void sim_host_run(void) {
+	for (;;) {
+		if (sim_now < sim_host_next_event()) {
+			return;
+		}
+		switch (state) {
+		case HOST_SET_RATE:
+			send_command(LASERSHARK_CMD_SET_ILDA_RATE, cfg.rate);
+			state = HOST_WAIT_RATE;
+			break;
+		case HOST_FORMAT:
+			send_command(LASERSHARK_CMD_SET_DATA_FORMAT, LASERSHARK_DATA_COMPRESSED);
+			state = HOST_WAIT_FORMAT;
+			break;
+		case HOST_COMMAND:
+			if (commands_sent == cfg.command_count) {
+				state = HOST_PREFILL;
+				break;
+			}
+			send_hex_command(cfg.commands[commands_sent++]);
+			state = HOST_WAIT_COMMAND;
+			break;
+		case HOST_PREFILL:
+			if (samples_sent >= cfg.ahead) {
+				state = HOST_ENABLE;
+				break;
+			}
+			if (cfg.iso) {
+				send_samples(4, cfg.ahead - samples_sent, SIM_HOST_ISO_BYTES);
+			} else {
+				send_packet(cfg.ahead - samples_sent);
+			}
+			break;
+		case HOST_ENABLE:
+			send_command(LASERSHARK_CMD_SET_OUTPUT, LASERSHARK_CMD_OUTPUT_ENABLE);
+			state = HOST_WAIT_ENABLE;
+			break;
+		case HOST_STREAM:
+			if (cfg.iso) {
+				send_iso_packet();
+			} else {
+				send_packet(UINT32_MAX);
+			}
+			break;
+		case HOST_REPLAY:
+			send(pending.ep, pending.data, pending.len);
+			if (!replay_load()) {
+				state = HOST_DONE;
+			}
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+uint64_t sim_host_next_event(void) {
+	uint64_t t;
+
+	switch (state) {
+	case HOST_SET_RATE:
+		return SIM_HOST_START_CYCLES;
+	case HOST_FORMAT:
+	case HOST_COMMAND:
+		return sim_now;
+	case HOST_PREFILL:
+	case HOST_ENABLE:
+		if (cfg.iso) {
+			return sim_usb_host_pending(4) ? SIM_NEVER : sim_now;
+		}
+		return sim_usb_host_pending(3) < SIM_HOST_IN_FLIGHT ? sim_now : SIM_NEVER;
+	case HOST_STREAM:
+		if (cfg.iso) {
+			// The next packet is queued as soon as the last one has gone out.
+			t = sim_usb_host_pending(4) ? SIM_NEVER : sim_now;
+		} else if (sim_usb_host_pending(3) >= SIM_HOST_IN_FLIGHT) {
+			return SIM_NEVER;
+		} else {
+			t = stream_due();
+		}
+		if (t == SIM_NEVER) {
+			return t;
+		}
+		if (stalled(t)) {
+			uint64_t period = (uint64_t) cfg.stall_period_ms * 1000
+					* SIM_CYCLES_PER_US;
+			// Resume at the end of the stall and catch up from there.
+			t += period - (t - stream_start) % period;
+		}
+		return t;
+	case HOST_REPLAY:
+		return pending.t;
+	default:
+		return SIM_NEVER;
+	}
+}
+
+// Status records pushed on endpoint 2, and the last of them.
+static uint32_t status_count;
+static struct lasershark_status status_last;
+
+const struct lasershark_status *sim_host_status(uint32_t *count) {
+	*count = status_count;
+	return &status_last;
+}
+
+void sim_host_in(uint32_t ep, const uint8_t *buf, uint32_t len) {
+	if (ep == 2) {
+		memcpy(&status_last, buf, len < sizeof(status_last) ? len
+				: sizeof(status_last));
+		status_count++;
+		sim_log(sim_now, "status", "%u,%u,%u", status_last.frame,
+				status_last.empty_samples, status_last.underrun_events);
+		return;
+	}
+	sim_log(sim_now, "ep1_in", "%u,%u,%u", buf[0], buf[1], buf[2]);
+	if (buf[1] != LASERSHARK_CMD_SUCCESS && !cfg.replay) {
+		sim_fatal("command %#x failed with %#x", buf[0], buf[1]);
+	}
+	if (state == HOST_WAIT_COMMAND || cfg.replay) {
+		printf("Reply to %02x:", buf[0]);
+		for (uint32_t i = 1; i < len; i++) {
+			printf(" %02x", buf[i]);
+		}
+		printf("\n");
+	}
+	if (state == HOST_WAIT_RATE && buf[0] == LASERSHARK_CMD_SET_ILDA_RATE) {
+		state = cfg.compressed ? HOST_FORMAT : HOST_COMMAND;
+	} else if (state == HOST_WAIT_FORMAT || state == HOST_WAIT_COMMAND) {
+		state = HOST_COMMAND;
+	} else if (state == HOST_WAIT_ENABLE && buf[0]
+			== LASERSHARK_CMD_SET_OUTPUT) {
+		state = HOST_STREAM;
+		stream_start = sim_now;
+	}
+}
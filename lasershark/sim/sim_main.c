@@ -0,0 +1,486 @@
+/*
+sim_main.c - Lasershark firmware host simulator.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs the firmware's output path against the peripheral and USB models,
+ * writes an optional timeline and prints a summary. The exit status is
+ * non-zero if the ring buffer ran dry while output was enabled, if the host
+ * wrote over samples that had not been played yet or if a rate change in the
+ * stream was not first held by the sample it came before, so the simulator can
+ * be used as a regression gate.
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "LPC13Uxx.h"
+#include "lasershark.h"
+#include "gpio.h"
+#include "usbhw.h"
+#include "profile.h"
+#include "config.h"
+#include "sim.h"
+
+struct stat {
+	uint64_t count;
+	uint64_t min, max, sum;
+};
+
+static FILE *timeline;
+
+static struct stat isr_duration[32], isr_latency[32];
+static struct stat dac_latency;
+static uint64_t busy_cycles;
+static int isr_depth;
+static uint64_t isr_top_entry;
+
+static uint64_t last_tick;
+static uint64_t ticks, dac_updates, spi_words;
+static bool tick_seen_dac;
+
+static uint32_t tmr_head_before;
+static bool tmr_enabled_before;
+static uint32_t usb_fill_before;
+static uint64_t usb_read_before;
+static uint32_t usb_dropped_before;
+
+static uint64_t underruns, overruns;
+static uint32_t low_water = LASERSHARK_RINGBUFFER_SAMPLES;
+static bool streaming;
+
+// Stream samples the output has taken from the ring buffer. For -R, the one
+// the rate change comes before, and for it and the ones either side the tick
+// whose DAC update shows them and when that was.
+static uint64_t samples_taken;
+static uint64_t rate_at;
+static uint64_t rate_shown_tick[3], rate_shown[3];
+static uint64_t tick_dac;
+
+static void stat_add(struct stat *s, uint64_t v) {
+	if (!s->count || v < s->min) {
+		s->min = v;
+	}
+	if (v > s->max) {
+		s->max = v;
+	}
+	s->sum += v;
+	s->count++;
+}
+
+static void stat_print(const char *what, const struct stat *s) {
+	if (!s->count) {
+		printf("  %-28s none\n", what);
+		return;
+	}
+	printf("  %-28s min %6llu  mean %8.1f  max %6llu cycles\n", what,
+			(unsigned long long) s->min, (double) s->sum / s->count,
+			(unsigned long long) s->max);
+}
+
+/*
+ * Notes which tick's DAC update will show stream sample s if it is next to the
+ * -R rate change: the tick that took it or, when the update is timed, the one
+ * after. An untimed update may have gone out already.
+ */
+static void rate_check_taken(uint64_t s) {
+	uint64_t tick = ticks + (LASERSHARK_DAC_TIMED_UPDATE ? 1 : 0);
+
+	if (!rate_at || s + 1 < rate_at || s > rate_at + 1) {
+		return;
+	}
+	if (tick == ticks && tick_seen_dac) {
+		rate_shown[s + 1 - rate_at] = tick_dac;
+	} else {
+		rate_shown_tick[s + 1 - rate_at] = tick;
+	}
+}
+
+/*
+ * Checks how long the sample before the -R rate change and the one it came
+ * before were held, each against the period of the rate it should play at.
+ */
+static bool rate_check(uint32_t from, uint32_t to) {
+	double before = (double) SIM_CORE_CLOCK / from;
+	double after = (double) SIM_CORE_CLOCK / to;
+	double margin = fabs(before - after) / 2;
+	int64_t held_before = rate_shown[1] - rate_shown[0];
+	int64_t held_at = rate_shown[2] - rate_shown[1];
+
+	if (!rate_shown[0] || !rate_shown[1] || !rate_shown[2]) {
+		printf("Rate change before sample %llu: not reached\n",
+				(unsigned long long) rate_at);
+		return false;
+	}
+	printf("Rate change before sample %llu: sample before held %lld cycles"
+			" (%.0f), sample at %lld cycles (%.0f)\n",
+			(unsigned long long) rate_at, (long long) held_before, before,
+			(long long) held_at, after);
+	return fabs(held_before - before) < margin && fabs(held_at - after) < margin;
+}
+
+static uint32_t ring_fill(void) {
+	return (lasershark_ringbuffer_tail + LASERSHARK_RINGBUFFER_SAMPLES
+			- lasershark_ringbuffer_head) % LASERSHARK_RINGBUFFER_SAMPLES;
+}
+
+#if (PROFILE_ENABLED)
+// What the firmware's own profiling gives for LASERSHARK_CMD_GET_PROFILE.
+static void print_profile(const char *what, uint32_t point) {
+	uint32_t v[PROFILE_REPORT_SIZE / sizeof(uint32_t)], i;
+
+	profile_get(point, (uint8_t *) v);
+	printf("Device profile %s: %u runs, min %u mean %u max %u cycles\n  buckets",
+			what, v[0], v[1], v[3], v[2]);
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		printf(" %u", v[4 + i]);
+	}
+	putchar('\n');
+}
+#endif
+
+void sim_fatal(const char *fmt, ...) {
+	va_list ap;
+
+	fflush(stdout);
+	fprintf(stderr, "lasershark-sim: cycle %llu: ", (unsigned long long) sim_now);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(2);
+}
+
+void sim_log(uint64_t t, const char *event, const char *fmt, ...) {
+	va_list ap;
+
+	if (!timeline) {
+		return;
+	}
+	fprintf(timeline, "%llu,%s,", (unsigned long long) t, event);
+	va_start(ap, fmt);
+	vfprintf(timeline, fmt, ap);
+	va_end(ap);
+	fputc('\n', timeline);
+}
+
+void sim_poll(void) {
+	sim_host_run();
+	sim_periph_sync();
+	sim_usb_sync();
+	sim_irq_dispatch();
+}
+
+/*
+ * Hooks called by the models.
+ */
+
+void sim_on_tick(uint64_t t) {
+	last_tick = t;
+	tick_seen_dac = false;
+	ticks++;
+	sim_log(t, "tick", "%u,%u", lasershark_ringbuffer_head,
+			lasershark_ringbuffer_tail);
+}
+
+void sim_on_isr_enter(int irqn) {
+	if (!isr_depth++) {
+		isr_top_entry = sim_now;
+	}
+	if (irqn == CT32B1_IRQn) {
+		tmr_head_before = lasershark_ringbuffer_head;
+		tmr_enabled_before = lasershark_output_enabled;
+	} else if (irqn == USB_IRQ_IRQn) {
+		usb_fill_before = ring_fill();
+		usb_read_before = sim_usb_bytes_read(3) + sim_usb_bytes_read(4);
+		usb_dropped_before = lasershark_stats.overrun_samples;
+	}
+}
+
+void sim_on_isr_exit(int irqn, uint64_t pend, uint64_t entry, uint64_t exit) {
+	stat_add(&isr_duration[irqn], exit - entry);
+	stat_add(&isr_latency[irqn], entry - pend);
+	sim_log(exit, "isr", "%s,%llu,%llu", sim_irq_name(irqn),
+			(unsigned long long) (entry - pend),
+			(unsigned long long) (exit - entry));
+	if (!--isr_depth) {
+		busy_cycles += exit - isr_top_entry + SIM_EXC_ENTRY_CYCLES
+				+ SIM_EXC_EXIT_CYCLES;
+	}
+
+	if (irqn == CT32B1_IRQn && tmr_enabled_before) {
+		streaming = true;
+		if (lasershark_ringbuffer_head == tmr_head_before) {
+			underruns++;
+			sim_log(exit, "underrun", "%u", lasershark_ringbuffer_head);
+		} else if (!lasershark_frame_mode) {
+			rate_check_taken(samples_taken++);
+			if (ring_fill() < low_water) {
+				low_water = ring_fill();
+			}
+		}
+	} else if (irqn == USB_IRQ_IRQn) {
+		uint64_t added = (sim_usb_bytes_read(3) + sim_usb_bytes_read(4)
+				- usb_read_before)
+				/ (LASERSHARK_ILDA_CHANNELS * sizeof(uint16_t));
+
+		bool overrun = usb_fill_before + added > LASERSHARK_RINGBUFFER_SAMPLES - 1;
+
+		// A compressed packet's length says nothing of how many samples it
+		// holds, and a frame being loaded has a room of its own, so for those
+		// the firmware's own count of drops is used.
+		if (lasershark_data_format != LASERSHARK_DATA_RAW || lasershark_frame_mode) {
+			added = lasershark_stats.overrun_samples - usb_dropped_before;
+			overrun = added != 0;
+		}
+		if (overrun) {
+			overruns++;
+			sim_log(exit, "overrun", "%u,%llu", usb_fill_before,
+					(unsigned long long) added);
+		}
+	}
+}
+
+void sim_on_spi(uint64_t t, uint16_t word) {
+	spi_words++;
+	sim_log(t, "spi", "%u,%u", word >> 12, word & 0x0FFF);
+}
+
+void sim_on_dac(uint64_t t, const uint16_t out[4]) {
+	uint32_t i;
+
+	dac_updates++;
+	if (ticks && !tick_seen_dac) {
+		tick_seen_dac = true;
+		tick_dac = t;
+		stat_add(&dac_latency, t - last_tick);
+		for (i = 0; i < 3; i++) {
+			if (rate_shown_tick[i] == ticks) {
+				rate_shown[i] = t;
+			}
+		}
+	}
+	sim_log(t, "dac", "%u,%u,%u,%u", out[0], out[1], out[2], out[3]);
+}
+
+void sim_on_pin(uint64_t t, const char *name, bool level) {
+	sim_log(t, "pin", "%s,%u", name, level);
+}
+
+void sim_on_usb(uint64_t t, uint32_t ep, uint32_t len) {
+	sim_log(t, "usb", "%u,%u", ep, len);
+}
+
+/*
+ * Boot, as main() does it, less the watchdog.
+ */
+
+static void sim_boot(void) {
+	GPIOInit();
+
+	LPC_IOCON->PIO1_1 = (1 << 0) | (0x1 << 3) | (1 << 7); // C
+	LPC_IOCON->PIO1_2 = (1 << 0) | (0x1 << 3) | (1 << 7); // INTL A
+	LPC_IOCON->PIO1_0 = (1 << 0) | (0x1 << 3) | (1 << 7); // INTL B
+
+	GPIOSetDir(LED_PORT, USR1_LED_BIT, 1);
+	GPIOSetDir(LED_PORT, USR2_LED_BIT, 1);
+
+	LPC_SYSCON->SYSAHBCLKCTRL |= (1 << 16);
+
+	lasershark_init();
+
+	USBIOClkConfig();
+	usb_populate_serialno();
+	USB_Init();
+
+	NVIC_SetPriority(USB_IRQ_IRQn, 2);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+			"usage: %s [options]\n"
+			"  -r pps          ILDA rate the host asks for (30000)\n"
+			"  -t ms           simulated time (250)\n"
+			"  -a samples      samples queued before output is enabled (384)\n"
+			"  -d ppm          host clock error against the device (0)\n"
+			"  -s period:ms    host stalls for ms every period ms\n"
+			"  -i              stream on the isochronous endpoint 4 instead of bulk\n"
+			"  -n              send bulk data as fast as the device takes it\n"
+			"  -z              send the samples compressed\n"
+			"  -R pps:sample   change to pps with a control word before this sample\n"
+			"  -x hex          also send this EP1 command once the rate is set\n"
+			"  -p file         replay a capture instead of generating traffic\n"
+			"  -w file         write the traffic sent to a capture\n"
+			"  -o file         write a CSV timeline\n"
+			"  -c cpi          cycles charged per stepped instruction (1.25)\n"
+			"  -m cpi          the same for instructions run from RAM (1.0)\n",
+			prog);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	struct sim_host_cfg cfg = { .rate = 30000, .ahead = 384 };
+	double ms = 250, cpi = 1.25, ram_cpi = 1.0;
+	uint64_t end, irq_cycles;
+	const struct lasershark_status *status;
+	uint32_t status_count;
+	bool rate_ok = true;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:t:a:d:s:inzR:x:p:w:o:c:m:h")) != -1) {
+		switch (opt) {
+		case 'r': cfg.rate = strtoul(optarg, NULL, 0); break;
+		case 't': ms = strtod(optarg, NULL); break;
+		case 'a': cfg.ahead = strtoul(optarg, NULL, 0); break;
+		case 'd': cfg.ppm = strtol(optarg, NULL, 0); break;
+		case 's':
+			if (sscanf(optarg, "%u:%u", &cfg.stall_period_ms, &cfg.stall_ms) != 2) {
+				usage(argv[0]);
+			}
+			break;
+		case 'i': cfg.iso = true; break;
+		case 'n': cfg.greedy = true; break;
+		case 'z': cfg.compressed = true; break;
+		case 'R':
+			if (sscanf(optarg, "%u:%llu", &cfg.rate_to,
+					(unsigned long long *) &cfg.rate_at) != 2 || !cfg.rate_at) {
+				usage(argv[0]);
+			}
+			break;
+		case 'x':
+			if (cfg.command_count == SIM_HOST_COMMANDS) {
+				usage(argv[0]);
+			}
+			cfg.commands[cfg.command_count++] = optarg;
+			break;
+		case 'p': cfg.replay = optarg; break;
+		case 'w':
+			cfg.record = fopen(optarg, "w");
+			if (!cfg.record) {
+				sim_fatal("cannot create %s", optarg);
+			}
+			break;
+		case 'o':
+			timeline = fopen(optarg, "w");
+			if (!timeline) {
+				sim_fatal("cannot create %s", optarg);
+			}
+			fprintf(timeline, "cycle,event,v0,v1,v2,v3\n");
+			break;
+		case 'c': cpi = strtod(optarg, NULL); break;
+		case 'm': ram_cpi = strtod(optarg, NULL); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (cfg.rate_at && cfg.rate_to == cfg.rate) {
+		usage(argv[0]);
+	}
+	rate_at = cfg.rate_at;
+	sim_cpi16 = (uint32_t) (cpi * 16 + 0.5);
+	sim_ram_cpi16 = (uint32_t) (ram_cpi * 16 + 0.5);
+	end = (uint64_t) (ms * 1000 * SIM_CYCLES_PER_US);
+
+	sim_cpu_init();
+	sim_periph_init();
+	sim_usb_init(cfg.ppm);
+	sim_irq_attach(CT32B1_IRQn, "CT32B1", CT32B1_IRQHandler);
+	sim_irq_attach(SSP0_IRQn, "SSP0", NULL);
+	sim_host_init(&cfg);
+
+	sim_cpu_call(sim_boot);
+
+	while (sim_now < end) {
+		uint64_t t = end, n;
+
+		sim_poll();
+		// Thread mode only feeds the watchdog, so skip ahead to whatever happens next.
+		if ((n = sim_periph_next_event()) < t) {
+			t = n;
+		}
+		if ((n = sim_usb_next_event()) < t) {
+			t = n;
+		}
+		if ((n = sim_host_next_event()) < t) {
+			t = n;
+		}
+		sim_now = t > sim_now ? t : sim_now + 1;
+	}
+
+	irq_cycles = sim_now;
+	printf("lasershark-sim: %u pps for %.1f ms (%llu cycles, %llu instructions stepped)\n",
+			cfg.rate, ms, (unsigned long long) irq_cycles,
+			(unsigned long long) sim_cpu_steps());
+	printf("CT32B1 ISR (%llu runs):\n",
+			(unsigned long long) isr_duration[CT32B1_IRQn].count);
+	stat_print("duration", &isr_duration[CT32B1_IRQn]);
+	stat_print("entry latency", &isr_latency[CT32B1_IRQn]);
+	printf("USB ISR (%llu runs):\n",
+			(unsigned long long) isr_duration[USB_IRQ_IRQn].count);
+	stat_print("duration", &isr_duration[USB_IRQ_IRQn]);
+	stat_print("entry latency", &isr_latency[USB_IRQ_IRQn]);
+	printf("DAC (%llu updates, %llu SPI words):\n",
+			(unsigned long long) dac_updates, (unsigned long long) spi_words);
+	stat_print("tick to output update", &dac_latency);
+	if (dac_latency.count) {
+		printf("  %-28s %llu cycles\n", "jitter (max - min)",
+				(unsigned long long) (dac_latency.max - dac_latency.min));
+	}
+	printf("CPU load in interrupts: %.1f%%\n", 100.0 * busy_cycles / sim_now);
+	printf("Ring buffer low water: %u of %u samples\n", streaming ? low_water : 0,
+			LASERSHARK_RINGBUFFER_SAMPLES);
+	printf("Underruns: %llu  Overruns: %llu  SSP receive overruns: %u\n",
+			(unsigned long long) underruns, (unsigned long long) overruns,
+			sim_periph_ssp_overruns());
+	printf("Device stats: underruns %u (%u samples, frame %u), overruns %u"
+			" samples (frame %u), ISR latency max %u, low water %u\n",
+			lasershark_stats.underrun_events, lasershark_stats.underrun_samples,
+			lasershark_stats.underrun_frame, lasershark_stats.overrun_samples,
+			lasershark_stats.overrun_frame, lasershark_stats.isr_latency_max,
+			lasershark_stats.low_water);
+#if (PROFILE_ENABLED)
+	print_profile("CT32B1_IRQHandler", PROFILE_CT32B1_IRQ);
+	print_profile("USB_IRQHandler", PROFILE_USB_IRQ);
+	print_profile("USB_EndPoint3", PROFILE_USB_EP3);
+#endif
+	printf("Device clock drift: %d ppb, crystal %d ppb, over %u windows, trim %d ppb\n",
+			lasershark_drift_ppb, lasershark_crystal_ppb,
+			lasershark_drift_windows, lasershark_trim_ppb);
+	status = sim_host_status(&status_count);
+	printf("Status records: %u, last in frame %u: %u empty samples, %u underruns,"
+			" %u overruns, drift %d ppb\n", status_count, status->frame,
+			status->empty_samples, status->underrun_events,
+			status->overrun_samples, status->drift_ppb);
+	if (cfg.iso) {
+		printf("Isochronous packets lost: %llu\n",
+				(unsigned long long) sim_usb_iso_lost(4));
+	}
+	if (rate_at) {
+		rate_ok = rate_check(cfg.rate, cfg.rate_to);
+	}
+
+	if (timeline) {
+		fclose(timeline);
+	}
+	if (cfg.record) {
+		fclose(cfg.record);
+	}
+	return underruns || overruns || !rate_ok ? 1 : 0;
+}
@@ -0,0 +1,496 @@
+/*
+sim_periph.c - Lasershark firmware host simulator.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Register level models of the peripherals on the output path: CT32B1 (the
+ * sample clock), SSP0 with a DAC124S085 on the other end of the wire, and the
+ * GPIO block that drives C and INTL_A. Everything else on the APB and AHB is
+ * plain memory, so clock and pin setup code simply runs.
+ */
+
+#include <string.h>
+#include "LPC13Uxx.h"
+#include "sim.h"
+
+// Extra core cycles an access to a peripheral costs, over a RAM access.
+#define SIM_APB_WAIT 2
+#define SIM_GPIO_WAIT 0
+
+#define SIM_SSP_FIFO 8
+// Setting up the first frame after the SSP went idle.
+#define SIM_SSP_START_CYCLES 2
+
+uint32_t SystemCoreClock = SIM_CORE_CLOCK;
+
+/* CT32B1 */
+static struct {
+	uint32_t ir, tcr, pr, mcr, mr[4], emr, ctcr, pwmc, ccr;
+	uint32_t held; // TC while the counter is stopped.
+	uint64_t t0; // When TC was last 0, while running.
+	uint64_t next; // Next MR0 match that has not been handled yet.
+} tmr;
+
+/* SSP0 and the DAC124S085 */
+static struct {
+	uint32_t cr0, cr1, cpsr, imsc, ris;
+	uint16_t tx[SIM_SSP_FIFO], rx[SIM_SSP_FIFO];
+	uint32_t tx_head, tx_count, rx_head, rx_count;
+	bool shifting;
+	uint16_t shift;
+	uint64_t shift_done;
+	uint64_t rx_touched; // Last time the receive FIFO was written or read.
+	uint32_t overruns;
+} ssp;
+
+static uint16_t dac_in[4], dac_out[4];
+
+/* GPIO */
+static struct {
+	uint32_t out[2], dir[2], mask[2], in[2];
+	uint32_t level[2]; // Last level reported for the watched pins.
+} gpio;
+
+static const struct {
+	uint32_t port, pin;
+	const char *name;
+} watched[] = { { 1, 1, "C" }, { 1, 2, "INTL_A" } };
+
+/*
+ * CT32B1
+ */
+
+static uint64_t tmr_tick(void) {
+	return (uint64_t) tmr.pr + 1;
+}
+
+static uint32_t tmr_tc(void) {
+	if (!(tmr.tcr & 1) || (tmr.tcr & 2)) {
+		return tmr.held;
+	}
+	if (sim_now < tmr.t0) {
+		return tmr.mr[0]; // The tick between a match and the reset it causes.
+	}
+	return (sim_now - tmr.t0) / tmr_tick();
+}
+
+/*
+ * Find the next MR0 match from the current TC. A TC that was just written
+ * with the value of MR0 matches straight away; otherwise a match on the tick
+ * in progress has already been taken and TC has to wrap to see MR0 again.
+ */
+static void tmr_rearm(bool tc_written) {
+	uint32_t tc;
+	uint64_t ticks;
+
+	if (!(tmr.tcr & 1) || (tmr.tcr & 2) || !(tmr.mcr & 7)) {
+		tmr.next = SIM_NEVER;
+		return;
+	}
+	if (sim_now < tmr.t0) {
+		tmr.next = tmr.t0 + (uint64_t) tmr.mr[0] * tmr_tick();
+		return;
+	}
+	tc = tmr_tc();
+	ticks = (uint32_t) (tmr.mr[0] - tc);
+	if (!ticks && !tc_written) {
+		ticks = 1ull << 32;
+	}
+	tmr.next = tmr.t0 + ((uint64_t) tc + ticks) * tmr_tick();
+}
+
+static void tmr_sync(void) {
+	while (tmr.next <= sim_now) {
+		uint64_t t = tmr.next;
+
+		if (tmr.mcr & 1) {
+			tmr.ir |= 1;
+			sim_irq_line(CT32B1_IRQn, true);
+			sim_on_tick(t);
+		}
+		if (tmr.mcr & 4) {
+			tmr.held = tmr.mr[0];
+			tmr.tcr &= ~1;
+			tmr.next = SIM_NEVER;
+		} else if (tmr.mcr & 2) {
+			// TC holds MR0 for one tick, then restarts from 0.
+			tmr.t0 = t + tmr_tick();
+			tmr.next = tmr.t0 + (uint64_t) tmr.mr[0] * tmr_tick();
+		} else {
+			tmr.next = t + (1ull << 32) * tmr_tick();
+		}
+	}
+}
+
+static uint32_t *tmr_reg(uint32_t off) {
+	switch (off) {
+	case 0x00: return &tmr.ir;
+	case 0x04: return &tmr.tcr;
+	case 0x0C: return &tmr.pr;
+	case 0x14: return &tmr.mcr;
+	case 0x18: case 0x1C: case 0x20: case 0x24: return &tmr.mr[(off - 0x18) / 4];
+	case 0x28: return &tmr.ccr;
+	case 0x3C: return &tmr.emr;
+	case 0x70: return &tmr.ctcr;
+	case 0x74: return &tmr.pwmc;
+	}
+	return NULL;
+}
+
+static uint32_t tmr_read(uint32_t addr, bool side_effects) {
+	uint32_t off = addr - LPC_CT32B1_BASE, *reg;
+
+	tmr_sync();
+	if (off == 0x08) {
+		return tmr_tc();
+	}
+	if (off == 0x10) {
+		return (tmr.tcr & 1) ? (sim_now - tmr.t0) % tmr_tick() : 0;
+	}
+	reg = tmr_reg(off);
+	return reg ? *reg : 0;
+}
+
+static void tmr_write(uint32_t addr, uint32_t val) {
+	uint32_t off = addr - LPC_CT32B1_BASE, *reg;
+	uint32_t tc;
+
+	tmr_sync();
+	tc = tmr_tc();
+	switch (off) {
+	case 0x00:
+		tmr.ir &= ~val;
+		if (!(tmr.ir & 1)) {
+			sim_irq_line(CT32B1_IRQn, false);
+		}
+		return;
+	case 0x04:
+		if (val & 2) {
+			tc = 0;
+		}
+		tmr.tcr = val & 3;
+		break;
+	case 0x08:
+		tc = val;
+		break;
+	case 0x0C:
+		tmr.pr = val;
+		break;
+	case 0x10:
+		return;
+	default:
+		reg = tmr_reg(off);
+		if (reg) {
+			*reg = val;
+		}
+		tmr_rearm(false);
+		return;
+	}
+	// TC, PR or TCR changed: count on from the value TC has now.
+	tmr.held = tc;
+	tmr.t0 = sim_now - (uint64_t) tc * tmr_tick();
+	tmr_rearm(off == 0x08);
+}
+
+/*
+ * SSP0 and DAC124S085
+ */
+
+static uint32_t ssp_bits(void) {
+	return (ssp.cr0 & 0xF) + 1;
+}
+
+static uint32_t ssp_bit_cycles(void) {
+	uint32_t div = LPC_SYSCON->SSP0CLKDIV ? LPC_SYSCON->SSP0CLKDIV : 1;
+	uint32_t cpsr = ssp.cpsr ? ssp.cpsr : 2;
+
+	return cpsr * (((ssp.cr0 >> 8) & 0xFF) + 1) * div;
+}
+
+static uint64_t ssp_frame_cycles(void) {
+	// Back to back CPHA=1 frames still lose about a bit time between words.
+	return (uint64_t) (ssp_bits() + 1) * ssp_bit_cycles();
+}
+
+static void dac_frame(uint64_t t, uint16_t word) {
+	uint32_t reg = word >> 14, op = (word >> 12) & 3, i;
+	uint16_t data = word & 0x0FFF;
+
+	sim_on_spi(t, word);
+	switch (op) {
+	case 0:
+		dac_in[reg] = data;
+		break;
+	case 1:
+		dac_in[reg] = data;
+		memcpy(dac_out, dac_in, sizeof(dac_out));
+		sim_on_dac(t, dac_out);
+		break;
+	case 2:
+		for (i = 0; i < 4; i++) {
+			dac_in[i] = data;
+		}
+		memcpy(dac_out, dac_in, sizeof(dac_out));
+		sim_on_dac(t, dac_out);
+		break;
+	default:
+		// Power down; the outputs go to a fixed impedance.
+		break;
+	}
+}
+
+static void ssp_start(uint64_t t) {
+	ssp.shift = ssp.tx[ssp.tx_head];
+	ssp.tx_head = (ssp.tx_head + 1) % SIM_SSP_FIFO;
+	ssp.tx_count--;
+	ssp.shifting = true;
+	ssp.shift_done = t + ssp_frame_cycles();
+}
+
+static void ssp_update_irq(void) {
+	uint64_t timeout = (uint64_t) 32 * ssp_bit_cycles();
+
+	ssp.ris &= ~0xE;
+	if (ssp.rx_count && sim_now - ssp.rx_touched >= timeout) {
+		ssp.ris |= 0x2;
+	}
+	if (ssp.rx_count >= SIM_SSP_FIFO / 2) {
+		ssp.ris |= 0x4;
+	}
+	if (ssp.tx_count <= SIM_SSP_FIFO / 2) {
+		ssp.ris |= 0x8;
+	}
+	sim_irq_line(SSP0_IRQn, (ssp.ris & ssp.imsc) != 0);
+}
+
+static void ssp_sync(void) {
+	while (ssp.shifting && ssp.shift_done <= sim_now) {
+		uint64_t t = ssp.shift_done;
+
+		if (ssp.rx_count == SIM_SSP_FIFO) {
+			ssp.ris |= 0x1;
+			ssp.overruns++;
+		} else {
+			// Nothing drives MISO on this board.
+			ssp.rx[(ssp.rx_head + ssp.rx_count) % SIM_SSP_FIFO] = 0xFFFF;
+			ssp.rx_count++;
+			ssp.rx_touched = t;
+		}
+		dac_frame(t, ssp.shift);
+		ssp.shifting = false;
+		if (ssp.tx_count && (ssp.cr1 & 2)) {
+			ssp_start(t);
+		}
+	}
+	ssp_update_irq();
+}
+
+static uint32_t ssp_read(uint32_t addr, bool side_effects) {
+	uint32_t v;
+
+	ssp_sync();
+	switch (addr - LPC_SSP0_BASE) {
+	case 0x00: return ssp.cr0;
+	case 0x04: return ssp.cr1;
+	case 0x08:
+		if (!ssp.rx_count) {
+			return 0;
+		}
+		v = ssp.rx[ssp.rx_head];
+		if (side_effects) {
+			ssp.rx_head = (ssp.rx_head + 1) % SIM_SSP_FIFO;
+			ssp.rx_count--;
+			ssp.rx_touched = sim_now;
+			ssp_update_irq();
+		}
+		return v;
+	case 0x0C:
+		return (ssp.tx_count == 0) | ((ssp.tx_count < SIM_SSP_FIFO) << 1)
+				| ((ssp.rx_count != 0) << 2) | ((ssp.rx_count
+				== SIM_SSP_FIFO) << 3) | ((ssp.shifting || ssp.tx_count) << 4);
+	case 0x10: return ssp.cpsr;
+	case 0x14: return ssp.imsc;
+	case 0x18: return ssp.ris;
+	case 0x1C: return ssp.ris & ssp.imsc;
+	}
+	return 0;
+}
+
+static void ssp_write(uint32_t addr, uint32_t val) {
+	ssp_sync();
+	switch (addr - LPC_SSP0_BASE) {
+	case 0x00: ssp.cr0 = val; break;
+	case 0x04: ssp.cr1 = val; break;
+	case 0x08:
+		if (ssp.tx_count == SIM_SSP_FIFO) {
+			break; // Dropped, as on the part.
+		}
+		ssp.tx[(ssp.tx_head + ssp.tx_count) % SIM_SSP_FIFO] = val;
+		ssp.tx_count++;
+		break;
+	case 0x10: ssp.cpsr = val & 0xFE; break;
+	case 0x14: ssp.imsc = val & 0xF; break;
+	case 0x20:
+		ssp.ris &= ~(val & 0x1);
+		if (val & 0x2) {
+			ssp.rx_touched = sim_now;
+		}
+		break;
+	}
+	if (!ssp.shifting && ssp.tx_count && (ssp.cr1 & 2)) {
+		ssp_start(sim_now + SIM_SSP_START_CYCLES);
+	}
+	ssp_update_irq();
+}
+
+static uint64_t ssp_next_event(void) {
+	uint64_t t = SIM_NEVER;
+
+	if (ssp.shifting) {
+		t = ssp.shift_done;
+	} else if (ssp.rx_count && (ssp.imsc & 0x2) && !(ssp.ris & 0x2)) {
+		t = ssp.rx_touched + (uint64_t) 32 * ssp_bit_cycles();
+	}
+	return t;
+}
+
+uint32_t sim_periph_ssp_overruns(void) {
+	return ssp.overruns;
+}
+
+/*
+ * GPIO
+ */
+
+static uint32_t gpio_pin(uint32_t port) {
+	return (gpio.out[port] & gpio.dir[port]) | (gpio.in[port]
+			& ~gpio.dir[port]);
+}
+
+static void gpio_watch(void) {
+	uint32_t i;
+
+	for (i = 0; i < sizeof(watched) / sizeof(watched[0]); i++) {
+		uint32_t port = watched[i].port, bit = 1u << watched[i].pin;
+		uint32_t level = gpio_pin(port) & bit;
+
+		if (level != (gpio.level[port] & bit)) {
+			gpio.level[port] ^= bit;
+			sim_on_pin(sim_now, watched[i].name, level != 0);
+		}
+	}
+}
+
+static uint32_t gpio_read(uint32_t addr, bool side_effects) {
+	uint32_t off = addr - LPC_GPIO_BASE, port, v = 0, i;
+
+	if (off < 0x40) {
+		for (i = 0; i < 4; i++) {
+			port = (off + i) / 32;
+			v |= ((gpio_pin(port) >> ((off + i) % 32)) & 1) << (8 * i);
+		}
+		return v;
+	}
+	if (off >= 0x1000 && off < 0x1100) {
+		port = (off - 0x1000) / 128;
+		return (gpio_pin(port) >> ((off - 0x1000) / 4 % 32)) & 1 ? 0xFFFFFFFF : 0;
+	}
+	port = (off & 0x7F) / 4;
+	if (off < 0x2000 || port > 1) {
+		return 0;
+	}
+	switch (off & ~0x7F) {
+	case 0x2000: return gpio.dir[port];
+	case 0x2080: return gpio.mask[port];
+	case 0x2100: return gpio_pin(port);
+	case 0x2180: return gpio_pin(port) & ~gpio.mask[port];
+	case 0x2200: return gpio.out[port];
+	}
+	return 0;
+}
+
+static void gpio_write(uint32_t addr, uint32_t val) {
+	uint32_t off = addr - LPC_GPIO_BASE, port, i;
+
+	if (off < 0x40) {
+		uint32_t old = gpio_read(addr, false);
+
+		for (i = 0; i < 4; i++) {
+			uint32_t pin = (off + i) % 32, b = (val >> (8 * i)) & 0xFF;
+
+			// Only the byte lanes the store touched change anything.
+			if (b != ((old >> (8 * i)) & 0xFF)) {
+				port = (off + i) / 32;
+				gpio.out[port] = (gpio.out[port] & ~(1u << pin)) | ((b & 1) << pin);
+			}
+		}
+	} else if (off >= 0x1000 && off < 0x1100) {
+		uint32_t pin = (off - 0x1000) / 4 % 32;
+
+		port = (off - 0x1000) / 128;
+		gpio.out[port] = (gpio.out[port] & ~(1u << pin)) | ((val != 0) << pin);
+	} else if (off >= 0x2000 && (port = (off & 0x7F) / 4) <= 1) {
+		switch (off & ~0x7F) {
+		case 0x2000: gpio.dir[port] = val; break;
+		case 0x2080: gpio.mask[port] = val; break;
+		case 0x2100: gpio.out[port] = val; break;
+		case 0x2180:
+			gpio.out[port] = (gpio.out[port] & gpio.mask[port]) | (val
+					& ~gpio.mask[port]);
+			break;
+		case 0x2200: gpio.out[port] |= val; break;
+		case 0x2280: gpio.out[port] &= ~val; break;
+		case 0x2300: gpio.out[port] ^= val; break;
+		}
+	}
+	gpio_watch();
+}
+
+void sim_periph_set_input(uint32_t port, uint32_t pin, bool level) {
+	gpio.in[port] = (gpio.in[port] & ~(1u << pin)) | ((uint32_t) level << pin);
+	gpio_watch();
+}
+
+/*
+ * Common
+ */
+
+void sim_periph_init(void) {
+	// APB peripherals up to and including the USB block, then the GPIO block.
+	sim_cpu_map(LPC_I2C_BASE, LPC_USB_BASE + 0x4000 - LPC_I2C_BASE);
+	sim_cpu_map(LPC_GPIO_BASE, 0x4000);
+
+	sim_cpu_trap(LPC_CT32B1_BASE, 0x1000, SIM_APB_WAIT, tmr_read, tmr_write);
+	sim_cpu_trap(LPC_SSP0_BASE, 0x1000, SIM_APB_WAIT, ssp_read, ssp_write);
+	sim_cpu_trap(LPC_GPIO_BASE, 0x3000, SIM_GPIO_WAIT, gpio_read, gpio_write);
+
+	tmr.next = SIM_NEVER;
+	LPC_SYSCON->SSP0CLKDIV = 1;
+}
+
+void sim_periph_sync(void) {
+	tmr_sync();
+	ssp_sync();
+}
+
+uint64_t sim_periph_next_event(void) {
+	uint64_t t = ssp_next_event();
+
+	return tmr.next < t ? tmr.next : t;
+}
@@ -0,0 +1,489 @@
+/*
+sim_usb.c - Lasershark firmware host simulator.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Stand-in for the USB device stack in the LPC13Uxx boot ROM, reached by the
+ * firmware through the pointer table at 0x1FFF1FF8 exactly as on the part.
+ * The host is taken to select configuration 1 in the frame after the
+ * firmware connects; the rest of enumeration and EP0 are not modelled.
+ * Packets share one full speed bus. An OUT endpoint takes a
+ * packet only while its buffer is armed; the buffer stays busy (and the host
+ * is NAKed) from the OUT event until the firmware reads it out with ReadEP.
+ * The isochronous endpoint instead gets at most one packet a frame, sent
+ * right after SOF ahead of everything else, and a packet that finds the
+ * buffer busy is lost.
+ * ROM entry points are charged estimated cycle costs rather than stepped.
+ */
+
+#include <string.h>
+#include "LPC13Uxx.h"
+#include "power_api.h"
+#include "usbhw.h"
+#include "iap.h"
+#include "sim.h"
+
+#define SIM_USB_EPS 5
+#define SIM_USB_MAX_PACKET 512
+#define SIM_USB_QUEUE 64
+#define SIM_USB_EVENTS 64
+#define SIM_USB_ISO_EP 4 // As usbdesc.c declares it.
+#define SIM_USB_CONFIGURE (~1u) // Event queue index of the configure callback
+
+// Full speed: 12 Mbit/s is 6 core cycles a bit.
+#define SIM_USB_BYTE_CYCLES 48
+// Token, data PID and CRC, handshake, sync fields and inter-packet gaps.
+#define SIM_USB_PACKET_OVERHEAD 13
+#define SIM_USB_FRAME_CYCLES (SIM_CORE_CLOCK / 1000)
+
+// Estimated ROM costs, in core cycles.
+#define SIM_USB_ISR_CYCLES 60
+#define SIM_USB_EVENT_CYCLES 40
+#define SIM_USB_CALL_CYCLES 24
+
+#define SIM_ROM_TABLE 0x1FFF1FF8
+
+void USB_IRQHandler(void);
+
+struct usb_packet {
+	uint64_t t;
+	uint32_t len;
+	uint8_t data[SIM_USB_MAX_PACKET];
+};
+
+static struct {
+	struct usb_packet queue[SIM_USB_QUEUE]; // Sent by the host, not yet accepted.
+	uint32_t head, count;
+	bool armed;
+	uint64_t armed_at;
+	bool nak_event, nak_sent;
+	bool iso;
+	uint32_t iso_frame; // Frame the last isochronous packet went out in.
+	uint32_t len;
+	uint8_t buf[SIM_USB_MAX_PACKET];
+	uint64_t bytes_read;
+	uint64_t iso_lost;
+} out_eps[SIM_USB_EPS];
+
+static struct {
+	bool busy;
+	uint64_t written_at;
+	uint32_t len;
+	uint8_t buf[SIM_USB_MAX_PACKET];
+} in_eps[SIM_USB_EPS];
+
+static struct {
+	bool active, in;
+	uint32_t ep;
+	uint64_t done;
+} xfer;
+static uint64_t bus_free;
+
+static struct {
+	uint32_t index; // (ep << 1) | in, as RegisterEpHandler() takes it; ~0 for SOF.
+	uint32_t event;
+} events[SIM_USB_EVENTS];
+static uint32_t event_head, event_count;
+
+static struct {
+	USB_EP_HANDLER_T fn;
+	void *data;
+} handlers[SIM_USB_EPS * 2];
+
+static USB_CB_T sof_cb;
+static USB_CB_T configure_cb;
+static uint64_t frame_period; // Host frame length, in 1/65536ths of a core cycle.
+static uint64_t next_sof; // Same units.
+static uint64_t sof_at; // Start of the current frame, in core cycles.
+static uint32_t frame = 1;
+
+static struct {
+	USB_EP_HANDLER_T fn;
+	void *data;
+	uint32_t event;
+} call;
+
+static USB_CORE_CTRL_T rom_device;
+static bool configure_due; // Connected, the host to select a configuration next frame.
+
+static void post(uint32_t index, uint32_t event) {
+	if (event_count == SIM_USB_EVENTS) {
+		sim_fatal("USB event queue overflow");
+	}
+	events[(event_head + event_count) % SIM_USB_EVENTS].index = index;
+	events[(event_head + event_count) % SIM_USB_EVENTS].event = event;
+	event_count++;
+	sim_irq_line(USB_IRQ_IRQn, true);
+}
+
+static void call_handler(void) {
+	call.fn(hUsb, call.data, call.event);
+}
+
+static void call_sof(void) {
+	sof_cb(hUsb);
+}
+
+static void call_configure(void) {
+	configure_cb(hUsb);
+}
+
+/*
+ * ROM entry points
+ */
+
+static ErrorCode_t rom_init(USBD_HANDLE_T *phUsb, USB_CORE_DESCS_T *pDesc,
+		USBD_API_INIT_PARAM_T *param) {
+	int depth = sim_cpu_rom_enter(SIM_USB_CALL_CYCLES);
+	uint32_t ep;
+
+	*phUsb = &rom_device;
+	sof_cb = param->USB_SOF_Event;
+	configure_cb = param->USB_Configure_Event;
+	for (ep = 1; ep < SIM_USB_EPS; ep++) {
+		out_eps[ep].armed = true;
+		out_eps[ep].armed_at = sim_now;
+	}
+	sim_cpu_rom_exit(depth);
+	return LPC_OK;
+}
+
+// The host enumerates the device in the next frame and selects configuration 1.
+static void rom_connect(USBD_HANDLE_T h, uint32_t con) {
+	configure_due = con && configure_cb;
+}
+
+static void rom_isr(USBD_HANDLE_T h) {
+	int depth = sim_cpu_rom_enter(SIM_USB_ISR_CYCLES);
+
+	while (event_count) {
+		uint32_t index = events[event_head].index;
+		uint32_t event = events[event_head].event;
+
+		event_head = (event_head + 1) % SIM_USB_EVENTS;
+		event_count--;
+		sim_cpu_rom_exit(sim_cpu_rom_enter(SIM_USB_EVENT_CYCLES));
+		if (index == ~0u) {
+			sim_cpu_call(call_sof);
+		} else if (index == SIM_USB_CONFIGURE) {
+			sim_cpu_call(call_configure);
+		} else if (handlers[index].fn) {
+			call.fn = handlers[index].fn;
+			call.data = handlers[index].data;
+			call.event = event;
+			sim_cpu_call(call_handler);
+		}
+	}
+	sim_irq_line(USB_IRQ_IRQn, false);
+	sim_cpu_rom_exit(depth);
+}
+
+static uint32_t rom_read_ep(USBD_HANDLE_T h, uint32_t EPNum, uint8_t *pData) {
+	uint32_t ep = EPNum & 0x0F, len = 0;
+	int depth;
+
+	if (ep >= SIM_USB_EPS) {
+		return 0;
+	}
+	depth = sim_cpu_rom_enter(SIM_USB_CALL_CYCLES + (out_eps[ep].armed ? 0
+			: out_eps[ep].len));
+	if (!out_eps[ep].armed) {
+		len = out_eps[ep].len;
+		memcpy(pData, out_eps[ep].buf, len);
+		out_eps[ep].bytes_read += len;
+		out_eps[ep].armed = true;
+		out_eps[ep].armed_at = sim_now;
+		out_eps[ep].nak_sent = false;
+	}
+	sim_cpu_rom_exit(depth);
+	return len;
+}
+
+static uint32_t rom_write_ep(USBD_HANDLE_T h, uint32_t EPNum, uint8_t *pData,
+		uint32_t cnt) {
+	uint32_t ep = EPNum & 0x0F;
+	int depth;
+
+	if (ep >= SIM_USB_EPS || cnt > SIM_USB_MAX_PACKET) {
+		return 0;
+	}
+	depth = sim_cpu_rom_enter(SIM_USB_CALL_CYCLES + cnt);
+	memcpy(in_eps[ep].buf, pData, cnt);
+	in_eps[ep].len = cnt;
+	in_eps[ep].busy = true;
+	in_eps[ep].written_at = sim_now;
+	sim_cpu_rom_exit(depth);
+	return cnt;
+}
+
+static ErrorCode_t rom_enable_event(USBD_HANDLE_T h, uint32_t EPNum,
+		uint32_t event_type, uint32_t enable) {
+	uint32_t ep = EPNum & 0x0F;
+
+	if (event_type != USB_EVT_OUT_NAK || (EPNum & 0x80) || ep >= SIM_USB_EPS) {
+		return ERR_USBD_INVALID_REQ;
+	}
+	out_eps[ep].nak_event = enable != 0;
+	return LPC_OK;
+}
+
+static ErrorCode_t rom_register_ep_handler(USBD_HANDLE_T h, uint32_t ep_index,
+		USB_EP_HANDLER_T pfn, void *data) {
+	if (ep_index >= SIM_USB_EPS * 2) {
+		return ERR_USBD_INVALID_REQ;
+	}
+	handlers[ep_index].fn = pfn;
+	handlers[ep_index].data = data;
+	return LPC_OK;
+}
+
+static const USBD_HW_API_T rom_hw = {
+	.Init = rom_init,
+	.Connect = rom_connect,
+	.ISR = rom_isr,
+	.ReadEP = rom_read_ep,
+	.WriteEP = rom_write_ep,
+	.EnableEvent = rom_enable_event,
+};
+
+static const USBD_CORE_API_T rom_core = {
+	.RegisterEpHandler = rom_register_ep_handler,
+};
+
+static const USBD_API_T rom_usbd = {
+	.hw = &rom_hw,
+	.core = &rom_core,
+};
+
+static ROM rom_table = {
+	.pUSBD = &rom_usbd,
+};
+
+void iap_read_serial_number(unsigned int result_table[]) {
+	result_table[0] = IAP_CMD_SUCCESS;
+	result_table[1] = 0x0000005A;
+	result_table[2] = 0x5349004D;
+	result_table[3] = 0x4C415345;
+	result_table[4] = 0x52534841;
+}
+
+/*
+ * Bus
+ */
+
+static uint64_t packet_cycles(uint32_t len) {
+	return (uint64_t) (len + SIM_USB_PACKET_OVERHEAD) * SIM_USB_BYTE_CYCLES;
+}
+
+static uint64_t later(uint64_t a, uint64_t b) {
+	return a > b ? a : b;
+}
+
+// An isochronous packet queued before the current frame began goes out in it.
+static bool iso_due(uint32_t ep) {
+	return out_eps[ep].iso && out_eps[ep].count && out_eps[ep].iso_frame != frame
+			&& out_eps[ep].queue[out_eps[ep].head].t <= sof_at;
+}
+
+/*
+ * Pick the next transaction and when it can start: isochronous first, then
+ * IN, then bulk OUT by endpoint.
+ */
+static bool next_xfer(bool *in, uint32_t *ep, uint64_t *start) {
+	uint32_t i;
+
+	for (i = 1; i < SIM_USB_EPS; i++) {
+		if (iso_due(i)) {
+			*in = false;
+			*ep = i;
+			*start = later(bus_free, sof_at);
+			return true;
+		}
+	}
+	for (i = 1; i < SIM_USB_EPS; i++) {
+		if (in_eps[i].busy) {
+			*in = true;
+			*ep = i;
+			*start = later(bus_free, in_eps[i].written_at);
+			return true;
+		}
+	}
+	for (i = 1; i < SIM_USB_EPS; i++) {
+		if (!out_eps[i].iso && out_eps[i].count && out_eps[i].armed) {
+			*in = false;
+			*ep = i;
+			*start = later(later(bus_free, out_eps[i].armed_at),
+					out_eps[i].queue[out_eps[i].head].t);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void finish_xfer(void) {
+	uint32_t ep = xfer.ep;
+
+	bus_free = xfer.done;
+	xfer.active = false;
+	if (xfer.in) {
+		in_eps[ep].busy = false;
+		sim_host_in(ep, in_eps[ep].buf, in_eps[ep].len);
+		post((ep << 1) | 1, USB_EVT_IN);
+	} else {
+		struct usb_packet *p = &out_eps[ep].queue[out_eps[ep].head];
+
+		out_eps[ep].head = (out_eps[ep].head + 1) % SIM_USB_QUEUE;
+		out_eps[ep].count--;
+		if (out_eps[ep].iso) {
+			out_eps[ep].iso_frame = frame;
+			if (!out_eps[ep].armed) {
+				out_eps[ep].iso_lost++;
+				sim_log(xfer.done, "iso_lost", "%u,%u", ep, p->len);
+				return;
+			}
+		}
+		memcpy(out_eps[ep].buf, p->data, p->len);
+		out_eps[ep].len = p->len;
+		out_eps[ep].armed = false;
+		sim_on_usb(xfer.done, ep, p->len);
+		post(ep << 1, USB_EVT_OUT);
+	}
+}
+
+void sim_usb_sync(void) {
+	uint32_t ep;
+
+	while ((uint64_t) sim_now << 16 >= next_sof) {
+		sof_at = (next_sof + 0xFFFF) >> 16;
+		frame++;
+		next_sof += frame_period;
+		if (configure_due) {
+			configure_due = false;
+			rom_device.config_value = 1;
+			post(SIM_USB_CONFIGURE, USB_EVT_RESET);
+		}
+		if (sof_cb) {
+			post(~0u, USB_EVT_SOF);
+		}
+	}
+
+	for (;;) {
+		bool in;
+		uint64_t start;
+
+		if (xfer.active) {
+			if (xfer.done > sim_now) {
+				break;
+			}
+			finish_xfer();
+			continue;
+		}
+		if (!next_xfer(&in, &ep, &start) || start > sim_now) {
+			break;
+		}
+		xfer.active = true;
+		xfer.in = in;
+		xfer.ep = ep;
+		xfer.done = start + packet_cycles(in ? in_eps[ep].len
+				: out_eps[ep].queue[out_eps[ep].head].len);
+	}
+
+	for (ep = 1; ep < SIM_USB_EPS; ep++) {
+		if (out_eps[ep].nak_event && !out_eps[ep].nak_sent
+				&& out_eps[ep].count && !out_eps[ep].armed) {
+			out_eps[ep].nak_sent = true;
+			post(ep << 1, USB_EVT_OUT_NAK);
+		}
+	}
+}
+
+uint64_t sim_usb_next_event(void) {
+	uint64_t t = (next_sof + 0xFFFF) >> 16;
+	bool in;
+	uint32_t ep;
+	uint64_t start;
+
+	if (!sof_cb && !out_eps[SIM_USB_ISO_EP].count) {
+		t = SIM_NEVER;
+	}
+	if (xfer.active) {
+		return xfer.done < t ? xfer.done : t;
+	}
+	if (next_xfer(&in, &ep, &start) && start < t) {
+		t = start;
+	}
+	return t;
+}
+
+void sim_usb_host_out(uint32_t ep, const uint8_t *buf, uint32_t len) {
+	struct usb_packet *p;
+
+	if (ep >= SIM_USB_EPS || len > SIM_USB_MAX_PACKET) {
+		sim_fatal("host sent %u bytes to bad endpoint %u", len, ep);
+	}
+	if (out_eps[ep].count == SIM_USB_QUEUE) {
+		sim_fatal("host queue for EP%u overflowed", ep);
+	}
+	p = &out_eps[ep].queue[(out_eps[ep].head + out_eps[ep].count)
+			% SIM_USB_QUEUE];
+	p->t = sim_now;
+	p->len = len;
+	memcpy(p->data, buf, len);
+	out_eps[ep].count++;
+}
+
+uint32_t sim_usb_host_pending(uint32_t ep) {
+	return out_eps[ep].count;
+}
+
+uint64_t sim_usb_bytes_read(uint32_t ep) {
+	return out_eps[ep].bytes_read;
+}
+
+uint64_t sim_usb_iso_lost(uint32_t ep) {
+	return out_eps[ep].iso_lost;
+}
+
+/*
+ * The firmware leaves the USB registers to the ROM except for reading the
+ * frame number out of INFO.
+ */
+static uint32_t usb_read(uint32_t addr, bool side_effects) {
+	if (addr == (uint32_t) (uintptr_t) &LPC_USB->INFO) {
+		return frame & 0x7FF;
+	}
+	return 0;
+}
+
+static void usb_write(uint32_t addr, uint32_t val) {
+}
+
+void sim_usb_init(int32_t ppm) {
+	sim_cpu_map(SIM_ROM_TABLE & ~0xFFF, 0x1000);
+	sim_cpu_trap(LPC_USB_BASE, 0x1000, 0, usb_read, usb_write);
+	*(ROM **) (uintptr_t) SIM_ROM_TABLE = &rom_table;
+
+	// A host crystal running fast makes its frames short.
+	frame_period = ((uint64_t) SIM_USB_FRAME_CYCLES << 16) * 1000000
+			/ (1000000 + ppm);
+	next_sof = ((uint64_t) sim_now << 16) + frame_period;
+	out_eps[SIM_USB_ISO_EP].iso = true;
+
+	sim_irq_attach(USB_IRQ_IRQn, "USB", USB_IRQHandler);
+}
@@ -245,6 +245,11 @@ ResetISR(void) {
 	unsigned int LoadAddr, ExeAddr, SectionLen;
 	unsigned int *SectionTableAddr;
 
+	// SRAM1 and USB RAM come out of reset with their clocks off, and the
+	// sections below may be placed in them (__DATA/__BSS(RAM2/RAM3)), so
+	// turn their SYSAHBCLKCTRL bits on before filling them.
+	*(volatile unsigned int *) 0x40048080 |= (1 << 26) | (1 << 27);
+
 	// Load base address of Global Section Table
 	SectionTableAddr = &__data_section_table;
 
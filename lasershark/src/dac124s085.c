@@ -27,17 +27,16 @@ void dac124s085_init(void) {
 }
 
 
+/*
+ * Writes are queued in the SSP TX FIFO and sent while the caller carries on;
+ * the outputs update once the last frame has been shifted out. At most four
+ * frames are written per call, so the previous call's frames and this one's
+ * always fit in the 8 frame RX FIFO between drains.
+ */
 __inline void dac124s085_dac(volatile const uint16_t *abcd) {
-    SSPSendC16(DAC124S085_INPUT_REG_A | DAC124S085_OP_WRITE_NO_UPDATE | (DAC124S085_INPUT_REG_DATA_MASK & abcd[0])); // A
-    SSPSendC16(DAC124S085_INPUT_REG_B | DAC124S085_OP_WRITE_NO_UPDATE | (DAC124S085_INPUT_REG_DATA_MASK & abcd[1])); // B
-    SSPSendC16(DAC124S085_INPUT_REG_C | DAC124S085_OP_WRITE_NO_UPDATE | (DAC124S085_INPUT_REG_DATA_MASK & abcd[2])); // C
-    SSPSendC16(DAC124S085_INPUT_REG_D | DAC124S085_OP_WRITE_UPDATE_OUTPUTS | (DAC124S085_INPUT_REG_DATA_MASK & abcd[3])); // D
-}
-
-__inline void dac124s085_dac_chn_set(uint16_t reg, uint16_t val, bool update_outputs) {
-	if (reg != DAC124S085_INPUT_REG_A  && reg != DAC124S085_INPUT_REG_B && reg != DAC124S085_INPUT_REG_C && reg != DAC124S085_INPUT_REG_D)
-	{
-		return;
-	}
-    SSPSendC16(reg | (update_outputs ? DAC124S085_OP_WRITE_UPDATE_OUTPUTS : DAC124S085_OP_WRITE_NO_UPDATE) | (DAC124S085_INPUT_REG_DATA_MASK & val)); // D
+    SSPDrainRx();
+    SSPSendC16Queued(DAC124S085_INPUT_REG_A | DAC124S085_OP_WRITE_NO_UPDATE | (DAC124S085_INPUT_REG_DATA_MASK & abcd[0])); // A
+    SSPSendC16Queued(DAC124S085_INPUT_REG_B | DAC124S085_OP_WRITE_NO_UPDATE | (DAC124S085_INPUT_REG_DATA_MASK & abcd[1])); // B
+    SSPSendC16Queued(DAC124S085_INPUT_REG_C | DAC124S085_OP_WRITE_NO_UPDATE | (DAC124S085_INPUT_REG_DATA_MASK & abcd[2])); // C
+    SSPSendC16Queued(DAC124S085_INPUT_REG_D | DAC124S085_OP_WRITE_UPDATE_OUTPUTS | (DAC124S085_INPUT_REG_DATA_MASK & abcd[3])); // D
 }
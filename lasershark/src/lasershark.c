@@ -19,6 +19,7 @@
  */
 
 #include <string.h>
+#include <cr_section_macros.h>
 #include "LPC13Uxx.h"
 #include "lasershark.h"
 #include "gpio.h"
@@ -26,37 +27,285 @@
 #include "ssp.h"
 #include "timer32.h"
 #include "dac124s085.h"
+#include "profile.h"
+#include "usbuser.h"
+
+#if LASERSHARK_C_PORT != LASERSHARK_INTL_A_PORT \
+	|| LASERSHARK_INTL_A_PIN != LASERSHARK_C_PIN + 1 \
+	|| LASERSHARK_INTL_A_BITMASK != LASERSHARK_C_BITMASK << 1
+#error "INTL_A and C must be neighbouring pins on one port, in the order their bits are sent."
+#endif
+
+// Where the bits of a sample as sent (see lasershark_put_sample()) are kept.
+#define LASERSHARK_XYA_Y_SHIFT 12
+#define LASERSHARK_XYA_A_SHIFT 20
+#define LASERSHARK_XYA_A_MASK 0xFF0
+#define LASERSHARK_B_SHIFT 4
+#define LASERSHARK_AB_LOW_MASK 0x0F
+#define LASERSHARK_AB_LOW_B_SHIFT 4
+#define LASERSHARK_PINS_SHIFT 14
+
+/* What the hot path inlines must really be inlined: __INLINE is only a hint,
+and a helper GCC leaves out of line stays in flash. */
+#if (LASERSHARK_RAM_HOT_PATH)
+#define LASERSHARK_HOT_PATH __RAMFUNC(RAM)
+#define LASERSHARK_HOT_INLINE static __INLINE __attribute__((always_inline))
+#else
+#define LASERSHARK_HOT_PATH
+#define LASERSHARK_HOT_INLINE static __INLINE
+#endif
+
+#define LASERSHARK_USB_FRAME_NR_MASK 0x7FF // FRAME_NR in the USB INFO register
+#define LASERSHARK_DRIFT_PPB_MAX 1000000
+
+volatile uint32_t lasershark_ringbuffer_xya[LASERSHARK_RINGBUFFER_SAMPLES];
+__BSS(RAM3) volatile uint8_t lasershark_ringbuffer_b[LASERSHARK_RINGBUFFER_SAMPLES]; // SRAM1
+__BSS(RAM2) volatile uint8_t lasershark_ringbuffer_ab_low[LASERSHARK_RINGBUFFER_SAMPLES]; // USB RAM
+__BSS(RAM2) volatile uint8_t lasershark_ringbuffer_pins[LASERSHARK_RINGBUFFER_SAMPLES / 4]; // USB RAM
+
+// Fractions of a clock the sample periods have added up so far, in 1/2^32ths.
+static uint32_t lasershark_core_duration_acc;
+// The current rate's sample period before any trim, in 1/65536ths of a clock.
+static volatile uint64_t lasershark_nominal_period;
+
+static void lasershark_set_trim(int32_t trim_ppb);
+static bool lasershark_set_transform(const int32_t *matrix);
+static bool lasershark_set_warp(uint32_t first, uint32_t count, const unsigned char *data);
+static bool lasershark_warp_enable(uint32_t size);
+static uint32_t lasershark_gamma_straight(uint32_t i);
+static bool lasershark_set_gamma(uint32_t channel, const unsigned char *data);
+static bool lasershark_set_delays(const unsigned char *delays);
+static bool lasershark_frame_load();
+static uint32_t lasershark_get_reported_empty_count();
+static bool lasershark_set_data_format(uint32_t format);
+static uint64_t lasershark_get_period(void);
+
+// The drift measurement window in progress, and whether the rate has changed
+// since it opened.
+static bool lasershark_drift_window_open;
+static volatile bool lasershark_rate_changed;
+static uint32_t lasershark_drift_window_frame;
+static uint32_t lasershark_drift_window_clocks;
+
+// The servo's integral term, in parts per billion, and USB frames until it next runs.
+static int32_t lasershark_servo_integral;
+static uint32_t lasershark_servo_countdown;
+
+#if (LASERSHARK_DAC_TIMED_UPDATE)
+// The frame that updates the DAC outputs on the next tick, the pins set with
+// it and the rate to change to once it has, 0 if none.
+static uint16_t lasershark_dac_update_frame;
+static uint32_t lasershark_dac_update_pins;
+static uint32_t lasershark_dac_update_rate;
+#endif
+
+// A control word waiting for the output to reach index in the ring buffer.
+struct lasershark_control {
+	uint16_t index;
+	uint16_t op;
+	uint32_t arg;
+};
+__BSS(RAM3) static volatile struct lasershark_control lasershark_controls[LASERSHARK_CONTROL_QUEUE_SIZE]; // SRAM1
+static volatile uint32_t lasershark_control_head, lasershark_control_tail;
+
+// The last sample a compressed data packet made, as sent raw.
+static uint32_t lasershark_decode_ba, lasershark_decode_yx;
+// As set by LASERSHARK_PACK_STEP, and the samples made so far of a line cut
+// short by a full ring buffer and where it started.
+static uint32_t lasershark_line_step, lasershark_line_dwell;
+static uint32_t lasershark_line_done, lasershark_line_from;
+
+// See LASERSHARK_CMD_SET_TRANSFORM, and whether it is the identity or affine,
+// which are worked out the cheaper way.
+static int32_t lasershark_transform[LASERSHARK_TRANSFORM_SIZE];
+static enum {
+	LASERSHARK_TRANSFORM_NONE, LASERSHARK_TRANSFORM_AFFINE, LASERSHARK_TRANSFORM_PROJECTIVE
+} lasershark_transform_kind;
+
+// The warp mesh, row by row, each point's offsets being read with one load;
+// N, 0 with the warp off; and log2 of the width of a mesh cell.
+struct lasershark_warp_point {
+	int16_t dx;
+	int16_t dy;
+};
+__BSS(RAM3) static struct lasershark_warp_point lasershark_warp_mesh[LASERSHARK_WARP_SIZE_MAX
+		* LASERSHARK_WARP_SIZE_MAX]; // SRAM1
+static uint32_t lasershark_warp_size;
+static uint32_t lasershark_warp_shift;
+
+// The A and B curves, see LASERSHARK_CMD_SET_GAMMA, and a bit for each that
+// is other than straight. A straight one is passed by rather than looked up,
+// so that its top segment maps every value to itself.
+__BSS(RAM2) static uint16_t lasershark_gamma[LASERSHARK_GAMMA_CHANNELS][LASERSHARK_GAMMA_POINTS]; // USB RAM
+static uint32_t lasershark_gamma_on;
+
+// Frame loop mode: the front frame, which runs up to but not including end
+// in the ring buffer and is played while playing is set; the back frame,
+// which starts at back, has loaded samples so far and takes data packets
+// while loading is set; whether the back frame is to be swapped in; and the
+// passes played over front frames.
+static volatile uint32_t lasershark_frame_start, lasershark_frame_end;
+static volatile bool lasershark_frame_playing;
+static uint32_t lasershark_frame_back, lasershark_frame_loaded;
+static bool lasershark_frame_loading;
+static volatile bool lasershark_frame_swap;
+static volatile uint32_t lasershark_frame_passes;
+
+// The LASERSHARK_CMD_SET_DELAY delays, A's in the low byte up to INTL_A's in
+// the top one, so the output reads them all at once; and the samples played
+// since the output started or the ring buffer last ran dry, counting up to
+// LASERSHARK_DELAY_MAX.
+static volatile uint32_t lasershark_delays;
+static uint32_t lasershark_delay_played;
+
+// Set while the ring buffer is dry, so that a dry spell is counted as one underrun event.
+static bool lasershark_underrun;
 
 unsigned char OUT1Packet[LASERSHARK_USB_CTRL_SIZE]; //User application buffer for receiving and holding OUT packets sent from the host
 unsigned char IN1Packet[LASERSHARK_USB_CTRL_SIZE]; //User application buffer for sending IN packets to the host
 
-static inline void lasershark_set_interlock_a(bool val)
+static __INLINE void lasershark_set_interlock_a(bool val)
 {
-	GPIOSetBitValue(LASERSHARK_INTL_A_PORT, LASERSHARK_INTL_A_PIN, val);
+	if (val) {
+		LPC_GPIO->SET[LASERSHARK_INTL_A_PORT] = 1 << LASERSHARK_INTL_A_PIN;
+	} else {
+		LPC_GPIO->CLR[LASERSHARK_INTL_A_PORT] = 1 << LASERSHARK_INTL_A_PIN;
+	}
 }
 
-static inline bool lasershark_get_interlock_b()
+LASERSHARK_HOT_INLINE bool lasershark_get_interlock_b()
 {
-	return GPIOGetPinValue(LASERSHARK_INTL_B_PORT, LASERSHARK_INTL_B_PIN);
+	return LPC_GPIO->PIN[LASERSHARK_INTL_B_PORT] & 1 << LASERSHARK_INTL_B_PIN;
 }
 
 static __INLINE void lasershark_set_c(bool val)
 {
-	GPIOSetBitValue(LASERSHARK_C_PORT, LASERSHARK_C_PIN, val);
+	if (val) {
+		LPC_GPIO->SET[LASERSHARK_C_PORT] = 1 << LASERSHARK_C_PIN;
+	} else {
+		LPC_GPIO->CLR[LASERSHARK_C_PORT] = 1 << LASERSHARK_C_PIN;
+	}
+}
+
+// Sets INTL_A and C together from a sample's pin bits, C in bit 0 and INTL_A in bit 1.
+LASERSHARK_HOT_INLINE void lasershark_set_pins(uint32_t pins)
+{
+	LPC_GPIO->MPIN[LASERSHARK_PINS_PORT] = pins << LASERSHARK_C_PIN;
+}
+
+/*
+ * Outputs four built DAC frames and the pins, or with
+ * LASERSHARK_DAC_TIMED_UPDATE preloads them for the next tick.
+ */
+LASERSHARK_HOT_INLINE void lasershark_output_frames(volatile const uint16_t *frames, uint32_t pins)
+{
+#if (LASERSHARK_DAC_TIMED_UPDATE)
+	dac124s085_dac_preload_frames(frames);
+	lasershark_dac_update_frame = frames[3];
+	lasershark_dac_update_pins = pins;
+#else
+	lasershark_set_pins(pins);
+	dac124s085_dac_frames(frames);
+#endif
+}
+
+// Like lasershark_output_frames(), but for one sample's four values.
+LASERSHARK_HOT_INLINE void lasershark_output_values(uint16_t a, uint16_t b, uint16_t c, uint16_t d, uint32_t pins)
+{
+#if (LASERSHARK_DAC_TIMED_UPDATE)
+	dac124s085_dac_preload_values(a, b, c);
+	lasershark_dac_update_frame = DAC124S085_INPUT_REG_D
+			| DAC124S085_OP_WRITE_UPDATE_OUTPUTS | d;
+	lasershark_dac_update_pins = pins;
+#else
+	dac124s085_dac_values(a, b, c, d);
+	lasershark_set_pins(pins);
+#endif
+}
+
+// Turns the lasers off and leaves the galvos where they are.
+LASERSHARK_HOT_INLINE void lasershark_output_dark(void)
+{
+#if (LASERSHARK_DAC_TIMED_UPDATE)
+	dac124s085_dac_chn_set(LASERSHARK_A_DAC_REG, DAC124S085_DAC_VAL_MIN,
+			false);
+	lasershark_dac_update_frame = LASERSHARK_B_DAC_REG
+			| DAC124S085_OP_WRITE_UPDATE_OUTPUTS | DAC124S085_DAC_VAL_MIN;
+	lasershark_dac_update_pins = 0;
+#else
+	lasershark_set_pins(0);
+	dac124s085_dac_chn_set(LASERSHARK_A_DAC_REG, DAC124S085_DAC_VAL_MIN,
+			false);
+	dac124s085_dac_chn_set(LASERSHARK_B_DAC_REG, DAC124S085_DAC_VAL_MIN,
+			true);
+#endif
+}
+
+static void lasershark_set_blank_frames(volatile uint16_t *frames)
+{
+	frames[0] = LASERSHARK_A_DAC_REG | DAC124S085_OP_WRITE_NO_UPDATE
+			| DAC124S085_DAC_VAL_MIN; // A
+	frames[1] = LASERSHARK_B_DAC_REG | DAC124S085_OP_WRITE_NO_UPDATE
+			| DAC124S085_DAC_VAL_MIN; // B
+	frames[2] = LASERSHARK_X_DAC_REG | DAC124S085_OP_WRITE_NO_UPDATE
+			| DAC124S085_DAC_VAL_MID; // X
+	frames[3] = LASERSHARK_Y_DAC_REG | DAC124S085_OP_WRITE_UPDATE_OUTPUTS
+			| DAC124S085_DAC_VAL_MID; // Y
 }
 
 void lasershark_init() {
 	int i, j = j;
+	int32_t matrix[LASERSHARK_TRANSFORM_SIZE];
+	uint16_t gamma[LASERSHARK_GAMMA_POINTS];
 	lasershark_output_enabled = false;
 	lasershark_ringbuffer_head = 0;
 	lasershark_ringbuffer_tail = 0;
+	lasershark_control_head = 0;
+	lasershark_control_tail = 0;
+	lasershark_frame_mode = false;
+	lasershark_frame_loading = false;
+	lasershark_frame_playing = false;
+	lasershark_frame_swap = false;
+	lasershark_frame_passes = 0;
+	lasershark_blank = false;
+	lasershark_set_data_format(LASERSHARK_DATA_RAW);
+	memset(matrix, 0, sizeof(matrix));
+	matrix[0] = LASERSHARK_TRANSFORM_ONE;
+	matrix[4] = LASERSHARK_TRANSFORM_ONE;
+	matrix[8] = LASERSHARK_TRANSFORM_ONE;
+	lasershark_set_transform(matrix);
+	memset(lasershark_warp_mesh, 0, sizeof(lasershark_warp_mesh));
+	lasershark_warp_enable(0);
+	for (i = 0; i < LASERSHARK_GAMMA_POINTS; i++) {
+		gamma[i] = lasershark_gamma_straight(i);
+	}
+	for (i = 0; i < LASERSHARK_GAMMA_CHANNELS; i++) {
+		lasershark_set_gamma(i, (const unsigned char *) gamma);
+	}
+	lasershark_ringbuffer_room_wanted = 0;
+	lasershark_ringbuffer_reserved = 0;
+	lasershark_delays = 0;
 	lasershark_ringbuffer_half_full_reporting = false;
-
+	lasershark_clear_stats();
+	lasershark_drift_ppb = 0;
+	lasershark_crystal_ppb = 0;
+	lasershark_drift_windows = 0;
+	lasershark_clock_trim = false;
+	lasershark_trim_ppb = 0;
+	lasershark_servo = false;
+	lasershark_servo_target = LASERSHARK_SERVO_TARGET_DEFAULT;
+	lasershark_servo_kp = LASERSHARK_SERVO_KP_DEFAULT;
+	lasershark_servo_ki = LASERSHARK_SERVO_KI_DEFAULT;
+#if (PROFILE_ENABLED)
+	profile_init();
+#endif
 
 	// Set lasershark pins to be inputs/outputs as appropriate ASAP!
 	GPIOSetDir(LASERSHARK_C_PORT, LASERSHARK_C_PIN, 1); // Output
 	GPIOSetDir(LASERSHARK_INTL_A_PORT, LASERSHARK_INTL_A_PIN, 1); // Output
 	GPIOSetDir(LASERSHARK_INTL_B_PORT, LASERSHARK_INTL_B_PIN, 0); // Input
+	// Only INTL_A and C are written through the masked port register.
+	LPC_GPIO->MASK[LASERSHARK_PINS_PORT] = ~LASERSHARK_PINS_MASK;
 
 	// Unlike the DAC output, these are not pulled down at start so we need to pull down these pins ASAP!
 	lasershark_set_interlock_a(0);
@@ -74,18 +323,16 @@ void lasershark_init() {
 			* lasershark_usb_data_packet_samp_count;
 
 	// This is buffer sent when the system is off
-	lasershark_blankingbuffer[0] = DAC124S085_DAC_VAL_MIN; // A
-	lasershark_blankingbuffer[1] = DAC124S085_DAC_VAL_MIN; // B
-	lasershark_blankingbuffer[2] = DAC124S085_INPUT_REG_DATA_MASK
-			& DAC124S085_DAC_VAL_MID; // INTL_A, C, X
-	lasershark_blankingbuffer[3] = DAC124S085_DAC_VAL_MID; // Y
+	lasershark_set_blank_frames(lasershark_blankingbuffer);
 
 	for (i = 0; i < LASERSHARK_RINGBUFFER_SAMPLES; i++) {
-		lasershark_ringbuffer[i][0] = DAC124S085_DAC_VAL_MIN; // A
-		lasershark_ringbuffer[i][1] = DAC124S085_DAC_VAL_MIN; // B
-		lasershark_ringbuffer[i][2] = DAC124S085_INPUT_REG_DATA_MASK
-				& DAC124S085_DAC_VAL_MID; // INTL_A, C, X
-		lasershark_ringbuffer[i][3] = DAC124S085_DAC_VAL_MID; // Y
+		lasershark_ringbuffer_xya[i] = DAC124S085_DAC_VAL_MID
+				| DAC124S085_DAC_VAL_MID << LASERSHARK_XYA_Y_SHIFT;
+		lasershark_ringbuffer_b[i] = 0;
+		lasershark_ringbuffer_ab_low[i] = 0;
+	}
+	for (i = 0; i < LASERSHARK_RINGBUFFER_SAMPLES / 4; i++) {
+		lasershark_ringbuffer_pins[i] = 0;
 	}
 
 	// dummy code to blink LEDS.. woo
@@ -175,7 +422,9 @@ void lasershark_init() {
 	}
 #endif
 
-	CT32B1_IRQHandler(); // The output is disabled, so the blank buffer will be sent.
+	// The output is disabled, so the blank buffer is sent until the timer takes over.
+	lasershark_set_pins(0);
+	dac124s085_dac_frames(lasershark_blankingbuffer);
 
 	init_timer32(1, lasershark_core_duration);
 	lasershark_set_ilda_rate(LASERSHARK_ILDA_RATE_DEFAULT);
@@ -184,169 +433,1477 @@ void lasershark_init() {
 
 }
 
-void lasershark_process_command() {
-	uint32_t temp;
-	IN1Packet[0] = OUT1Packet[0]; // Put the command sent in the "IN" buffer
-	IN1Packet[1] = LASERSHARK_CMD_SUCCESS; // Assume output will be success
+// The rate the sample clock achieves, trim included, as 16.16 fixed point.
+static uint32_t lasershark_get_achieved_rate()
+{
+	return ((uint64_t) SystemCoreClock << 32) / lasershark_get_period();
+}
 
-	switch (OUT1Packet[0]) {
+static void lasershark_get_device_info(struct lasershark_device_info *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->info_version = LASERSHARK_DEVICE_INFO_VERSION;
+	info->fw_major_version = LASERSHARK_FW_MAJOR_VERSION;
+	info->fw_minor_version = LASERSHARK_FW_MINOR_VERSION;
+	info->samp_element_count = LASERSHARK_ILDA_CHANNELS;
+	info->ilda_rate_max = lasershark_ilda_rate_max;
+	info->ringbuffer_sample_count = LASERSHARK_RINGBUFFER_SAMPLES;
+	info->packet_samp_count = lasershark_usb_data_packet_samp_count;
+	info->bulk_packet_samp_count = LASERSHARK_USB_DATA_BULK_SIZE
+			/ (LASERSHARK_ILDA_CHANNELS * sizeof(uint16_t));
+	info->dac_min = DAC124S085_DAC_VAL_MIN;
+	info->dac_max = DAC124S085_DAC_VAL_MAX;
+	info->ctrl_size = LASERSHARK_USB_CTRL_SIZE;
+	info->control_queue_size = LASERSHARK_CONTROL_QUEUE_SIZE;
+	info->core_clock = SystemCoreClock;
+	info->features = LASERSHARK_FEATURE_BATCH | LASERSHARK_FEATURE_CONTROL
+			| LASERSHARK_FEATURE_STATUS_EP | LASERSHARK_FEATURE_COMPRESSED
+			| LASERSHARK_FEATURE_FRAME_LOOP | LASERSHARK_FEATURE_LINES
+			| LASERSHARK_FEATURE_TRANSFORM | LASERSHARK_FEATURE_WARP
+			| LASERSHARK_FEATURE_GAMMA | LASERSHARK_FEATURE_DELAY;
+#if (LASERSHARK_USB_DATA_NAK)
+	info->features |= LASERSHARK_FEATURE_DATA_NAK;
+#endif
+#if (LASERSHARK_DAC_TIMED_UPDATE)
+	info->features |= LASERSHARK_FEATURE_DAC_TIMED_UPDATE;
+#endif
+#if (PROFILE_ENABLED)
+	info->features |= LASERSHARK_FEATURE_PROFILE;
+#endif
+}
+
+static void lasershark_get_runtime_state(struct lasershark_runtime_state *state)
+{
+	memset(state, 0, sizeof(*state));
+	lasershark_get_status(&state->status);
+	state->ilda_rate = lasershark_curr_ilda_rate;
+	state->achieved_ilda_rate = lasershark_get_achieved_rate();
+	state->sync_marker = lasershark_sync_marker;
+	state->servo = lasershark_servo;
+	state->clock_trim = lasershark_clock_trim;
+}
+
+/*
+ * Runs the command in cmd, writing its reply to reply, and returns the length
+ * of the reply.
+ */
+static uint32_t lasershark_run_command(const unsigned char *cmd, unsigned char *reply)
+{
+	uint32_t temp, len = 2;
+	struct lasershark_stats stats;
+	struct lasershark_device_info info;
+	struct lasershark_runtime_state state;
+	int32_t matrix[LASERSHARK_TRANSFORM_SIZE];
+	reply[0] = cmd[0]; // Put the command sent in the reply
+	reply[1] = LASERSHARK_CMD_SUCCESS; // Assume output will be success
+
+	switch (cmd[0]) {
 	case LASERSHARK_CMD_SET_OUTPUT: //Enable/Disable output
-		switch (OUT1Packet[1]) {
+		switch (cmd[1]) {
 		case LASERSHARK_CMD_OUTPUT_DISABLE: // Disable output
 			GPIOSetBitValue(LED_PORT, USR1_LED_BIT, 1); // 1 makes voltage across diode 0v
 			lasershark_output_enabled = false;
+			lasershark_blank = false; // The next stream starts lit
 			break;
 		case LASERSHARK_CMD_OUTPUT_ENABLE: // Enable output
 			GPIOSetBitValue(LED_PORT, USR1_LED_BIT, 0); // 0 makes voltage across diode >  0v
 			lasershark_output_enabled = true;
 			break;
 		default:
-			IN1Packet[1] = LASERSHARK_CMD_FAIL;
+			reply[1] = LASERSHARK_CMD_FAIL;
 			break;
 		}
 	case LASERSHARK_CMD_GET_OUTPUT: // Get enabled state
 		if (lasershark_output_enabled) {
-			IN1Packet[2] = LASERSHARK_CMD_OUTPUT_ENABLE;
+			reply[2] = LASERSHARK_CMD_OUTPUT_ENABLE;
 		} else {
-			IN1Packet[2] = LASERSHARK_CMD_OUTPUT_DISABLE;
+			reply[2] = LASERSHARK_CMD_OUTPUT_DISABLE;
 		}
+		len = 3;
 		break;
 	case LASERSHARK_CMD_SET_ILDA_RATE:
-		memcpy(&temp, OUT1Packet + 1, sizeof(uint32_t));
+		memcpy(&temp, cmd + 1, sizeof(uint32_t));
 		if (!lasershark_set_ilda_rate(temp)) { // Note: I tried calling without temp on a pic32, but discovered a weird MC bug.
-			IN1Packet[1] = LASERSHARK_CMD_FAIL;
+			reply[1] = LASERSHARK_CMD_FAIL;
 		}
 		break;
 	case LASERSHARK_CMD_GET_ILDA_RATE:
-		memcpy(IN1Packet + 2, &lasershark_curr_ilda_rate, sizeof(uint32_t));
+		memcpy(reply + 2, &lasershark_curr_ilda_rate, sizeof(uint32_t));
+		temp = lasershark_get_achieved_rate();
+		memcpy(reply + 6, &temp, sizeof(uint32_t));
+		len = 10;
 		break;
 	case LASERSHARK_CMD_GET_MAX_ILDA_RATE:
 		temp = lasershark_ilda_rate_max;
-		memcpy(IN1Packet + 2, &temp, sizeof(uint32_t));
+		memcpy(reply + 2, &temp, sizeof(uint32_t));
+		len = 6;
 		break;
 	case LASERSHARK_CMD_GET_SAMP_ELEMENT_COUNT:
 		temp = LASERSHARK_ILDA_CHANNELS;
-		memcpy(IN1Packet + 2, &temp, sizeof(uint32_t));
+		memcpy(reply + 2, &temp, sizeof(uint32_t));
+		len = 6;
 		break;
 	case LASERSHARK_CMD_GET_PACKET_SAMP_COUNT:
-		memcpy(IN1Packet + 2, &lasershark_usb_data_packet_samp_count,
+		memcpy(reply + 2, &lasershark_usb_data_packet_samp_count,
 				sizeof(uint32_t));
+		len = 6;
 		break;
 	case LASERSHARK_CMD_GET_DAC_MIN:
 		temp = DAC124S085_DAC_VAL_MIN;
-		memcpy(IN1Packet + 2, &temp, sizeof(uint32_t));
+		memcpy(reply + 2, &temp, sizeof(uint32_t));
+		len = 6;
 		break;
 	case LASERSHARK_CMD_GET_DAC_MAX:
 		temp = DAC124S085_DAC_VAL_MAX;
-		memcpy(IN1Packet + 2, &temp, sizeof(uint32_t));
+		memcpy(reply + 2, &temp, sizeof(uint32_t));
+		len = 6;
 		break;
 	case LASERSHARK_CMD_GET_RINGBUFFER_SAMPLE_COUNT:
 		temp = LASERSHARK_RINGBUFFER_SAMPLES;
-		memcpy(IN1Packet + 2, &temp, sizeof(uint32_t));
+		memcpy(reply + 2, &temp, sizeof(uint32_t));
+		len = 6;
 		break;
 	case LASERSHARK_CMD_GET_RINGBUFFER_EMPTY_SAMPLE_COUNT:
-		temp = lasershark_get_empty_sample_count();
-		memcpy(IN1Packet + 2, &temp, sizeof(uint32_t));
+		temp = lasershark_get_reported_empty_count();
+		memcpy(reply + 2, &temp, sizeof(uint32_t));
+		len = 6;
 		break;
 	case LASERSHARK_CMD_GET_LASERSHARK_FW_MAJOR_VERSION:
 		temp = LASERSHARK_FW_MAJOR_VERSION;
-		memcpy(IN1Packet + 2, &temp, sizeof(uint32_t));
+		memcpy(reply + 2, &temp, sizeof(uint32_t));
+		len = 6;
 		break;
 	case LASERSHARK_GMD_GET_LASERSHARK_FW_MINOR_VERSION:
 		temp = LASERSHARK_FW_MINOR_VERSION;
-		memcpy(IN1Packet + 2, &temp, sizeof(uint32_t));
+		memcpy(reply + 2, &temp, sizeof(uint32_t));
+		len = 6;
+		break;
+	case LASERSHARK_CMD_GET_STATS:
+		stats = lasershark_stats;
+		memcpy(reply + 2, &stats, sizeof(stats));
+		len = 2 + sizeof(stats);
+		break;
+	case LASERSHARK_CMD_CLEAR_STATS:
+		lasershark_clear_stats();
+		break;
+	case LASERSHARK_CMD_GET_CLOCK_DRIFT:
+		memcpy(reply + 2, &lasershark_drift_ppb, sizeof(int32_t));
+		memcpy(reply + 6, &lasershark_crystal_ppb, sizeof(int32_t));
+		memcpy(reply + 10, &lasershark_drift_windows, sizeof(uint32_t));
+		memcpy(reply + 14, &lasershark_trim_ppb, sizeof(int32_t));
+		len = 18;
+		break;
+	case LASERSHARK_CMD_SET_CLOCK_TRIM:
+		switch (cmd[1]) {
+		case 0:
+			lasershark_clock_trim = false;
+			lasershark_set_trim(0);
+			break;
+		case 1:
+			lasershark_servo = false;
+			lasershark_clock_trim = true;
+			break;
+		default:
+			reply[1] = LASERSHARK_CMD_FAIL;
+			break;
+		}
+		break;
+	case LASERSHARK_CMD_SET_SERVO:
+		memcpy(&temp, cmd + 2, sizeof(uint32_t));
+		if (cmd[1] > 1 || temp >= LASERSHARK_RINGBUFFER_SAMPLES) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+			break;
+		}
+		lasershark_servo_target = temp;
+		memcpy(&lasershark_servo_kp, cmd + 6, sizeof(uint32_t));
+		memcpy(&lasershark_servo_ki, cmd + 10, sizeof(uint32_t));
+		lasershark_servo_integral = lasershark_trim_ppb; // Carry on from the trim in place
+		lasershark_servo = cmd[1];
+		if (lasershark_servo) {
+			lasershark_clock_trim = false;
+		} else {
+			lasershark_set_trim(0);
+		}
+		break;
+	case LASERSHARK_CMD_GET_SERVO:
+		reply[2] = lasershark_servo;
+		memcpy(reply + 3, &lasershark_servo_target, sizeof(uint32_t));
+		memcpy(reply + 7, &lasershark_servo_kp, sizeof(uint32_t));
+		memcpy(reply + 11, &lasershark_servo_ki, sizeof(uint32_t));
+		memcpy(reply + 15, &lasershark_trim_ppb, sizeof(int32_t));
+		len = 19;
+		break;
+	case LASERSHARK_CMD_GET_SYNC:
+		memcpy(reply + 2, &lasershark_sync_marker, sizeof(uint32_t));
+		memcpy(reply + 6, &lasershark_sync_frame, sizeof(uint32_t));
+		memcpy(reply + 10, &lasershark_sync_count, sizeof(uint32_t));
+		len = 14;
+		break;
+	case LASERSHARK_CMD_GET_DEVICE_INFO:
+		lasershark_get_device_info(&info);
+		memcpy(reply + 2, &info, sizeof(info));
+		len = 2 + sizeof(info);
+		break;
+	case LASERSHARK_CMD_GET_RUNTIME_STATE:
+		lasershark_get_runtime_state(&state);
+		memcpy(reply + 2, &state, sizeof(state));
+		len = 2 + sizeof(state);
+		break;
+	case LASERSHARK_CMD_SET_DATA_FORMAT:
+		if (!lasershark_set_data_format(cmd[1])) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+		}
+		break;
+	case LASERSHARK_CMD_GET_DATA_FORMAT:
+		reply[2] = lasershark_data_format;
+		len = 3;
+		break;
+	case LASERSHARK_CMD_FRAME_LOAD:
+		if (!lasershark_frame_load()) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+		}
+		break;
+	case LASERSHARK_CMD_FRAME_SWAP:
+		if (!lasershark_frame_loading || !lasershark_frame_loaded) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+			break;
+		}
+		lasershark_frame_loading = false;
+		lasershark_frame_swap = true;
+		break;
+	case LASERSHARK_CMD_FRAME_STOP:
+		__disable_irq();
+		lasershark_frame_mode = false;
+		lasershark_frame_playing = false;
+		lasershark_frame_swap = false;
+		// Leave the ring empty rather than full of old samples and drop the
+		// control words queued against it.
+		lasershark_ringbuffer_tail = (lasershark_ringbuffer_head + 1)
+				% LASERSHARK_RINGBUFFER_SAMPLES;
+		lasershark_control_head = lasershark_control_tail;
+		lasershark_delay_played = 0;
+		lasershark_blank = false;
+		__enable_irq();
+		lasershark_frame_loading = false;
+		break;
+	case LASERSHARK_CMD_GET_FRAME:
+		reply[2] = lasershark_frame_mode;
+		reply[3] = lasershark_frame_swap;
+		temp = lasershark_frame_playing ? (lasershark_frame_end
+				+ LASERSHARK_RINGBUFFER_SAMPLES - lasershark_frame_start)
+				% LASERSHARK_RINGBUFFER_SAMPLES : 0;
+		reply[4] = temp;
+		reply[5] = temp >> 8;
+		reply[6] = lasershark_frame_loaded;
+		reply[7] = lasershark_frame_loaded >> 8;
+		temp = lasershark_frame_passes;
+		memcpy(reply + 8, &temp, sizeof(uint32_t));
+		len = 12;
+		break;
+	case LASERSHARK_CMD_SET_TRANSFORM:
+		// Data packets are read in the USB interrupt as well, so none sees
+		// half of the new matrix.
+		memcpy(matrix, cmd + 1, sizeof(matrix));
+		if (!lasershark_set_transform(matrix)) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+		}
+		break;
+	case LASERSHARK_CMD_GET_TRANSFORM:
+		memcpy(reply + 2, lasershark_transform, sizeof(lasershark_transform));
+		len = 2 + sizeof(lasershark_transform);
+		break;
+	case LASERSHARK_CMD_SET_WARP:
+		if (!lasershark_set_warp(cmd[1], cmd[2], cmd + 3)) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+		}
+		break;
+	case LASERSHARK_CMD_WARP_ENABLE:
+		if (!lasershark_warp_enable(cmd[1])) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+		}
+		break;
+	case LASERSHARK_CMD_GET_WARP:
+		reply[2] = lasershark_warp_size;
+		len = 3;
+		if (cmd[2] > LASERSHARK_WARP_POINTS_PER_CMD || cmd[1] + cmd[2]
+				> LASERSHARK_WARP_SIZE_MAX * LASERSHARK_WARP_SIZE_MAX) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+			break;
+		}
+		memcpy(reply + 3, lasershark_warp_mesh + cmd[1], cmd[2]
+				* sizeof(struct lasershark_warp_point));
+		len += cmd[2] * sizeof(struct lasershark_warp_point);
+		break;
+	case LASERSHARK_CMD_SET_GAMMA:
+		if (!lasershark_set_gamma(cmd[1], cmd + 2)) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+		}
+		break;
+	case LASERSHARK_CMD_GET_GAMMA:
+		if (cmd[1] >= LASERSHARK_GAMMA_CHANNELS) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+			break;
+		}
+		memcpy(reply + 2, lasershark_gamma[cmd[1]], sizeof(lasershark_gamma[0]));
+		len = 2 + sizeof(lasershark_gamma[0]);
+		break;
+	case LASERSHARK_CMD_SET_DELAY:
+		if (!lasershark_set_delays(cmd + 1)) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+		}
+		break;
+	case LASERSHARK_CMD_GET_DELAY:
+		temp = lasershark_delays;
+		memcpy(reply + 2, &temp, sizeof(uint32_t));
+		len = 6;
+		break;
+#if (PROFILE_ENABLED)
+	case LASERSHARK_CMD_GET_PROFILE:
+		if (!profile_get(cmd[1], reply + 2)) {
+			reply[1] = LASERSHARK_CMD_FAIL;
+		}
+		len = 2 + PROFILE_REPORT_SIZE;
+		break;
+	case LASERSHARK_CMD_CLEAR_PROFILE:
+		profile_clear();
 		break;
+#endif
 	default:
-		IN1Packet[1] = LASERSHARK_CMD_UNKNOWN;
+		reply[1] = LASERSHARK_CMD_UNKNOWN;
 		break;
 	}
+	return len;
+}
+
+/*
+ * Runs the commands packed in a LASERSHARK_CMD_BATCH packet in order, each
+ * seeing its bytes zero padded as if it had been sent alone, and packs their
+ * replies the same way.
+ */
+static void lasershark_run_batch()
+{
+	unsigned char cmd[LASERSHARK_USB_CTRL_SIZE];
+	unsigned char reply[LASERSHARK_USB_CTRL_SIZE];
+	uint32_t count = OUT1Packet[1];
+	uint32_t out = LASERSHARK_BATCH_CMD_OFFSET;
+	uint32_t in = LASERSHARK_BATCH_REPLY_OFFSET;
+	uint32_t len;
+
+	IN1Packet[0] = LASERSHARK_CMD_BATCH;
+	IN1Packet[1] = LASERSHARK_CMD_SUCCESS;
+	IN1Packet[2] = 0;
+	while (count--) {
+		if (out >= LASERSHARK_USB_CTRL_SIZE) {
+			IN1Packet[1] = LASERSHARK_CMD_FAIL; // More counted than sent
+			return;
+		}
+		len = OUT1Packet[out];
+		if (!len || out + 1 + len > LASERSHARK_USB_CTRL_SIZE
+				|| OUT1Packet[out + 1] == LASERSHARK_CMD_BATCH) {
+			IN1Packet[1] = LASERSHARK_CMD_FAIL;
+			return;
+		}
+		memset(cmd, 0, sizeof(cmd));
+		memcpy(cmd, OUT1Packet + out + 1, len);
+		out += 1 + len;
+
+		len = lasershark_run_command(cmd, reply);
+		if (in + 1 + len > LASERSHARK_USB_CTRL_SIZE) {
+			IN1Packet[1] = LASERSHARK_CMD_FAIL; // It ran, but its reply is lost
+			return;
+		}
+		IN1Packet[in] = len;
+		memcpy(IN1Packet + in + 1, reply, len);
+		in += 1 + len;
+		IN1Packet[2]++;
+	}
+}
 
+void lasershark_process_command() {
+	if (OUT1Packet[0] == LASERSHARK_CMD_BATCH) {
+		lasershark_run_batch();
+	} else {
+		lasershark_run_command(OUT1Packet, IN1Packet);
+	}
+}
+
+/*
+ * Starts loading a frame into whichever half of the ring buffer the front
+ * frame is not in, entering frame loop mode first if need be.
+ */
+static bool lasershark_frame_load()
+{
+	if (lasershark_frame_swap) {
+		return false; // The back frame is yet to be taken
+	}
+	if (!lasershark_frame_mode) {
+		__disable_irq();
+		lasershark_frame_mode = true;
+		lasershark_frame_playing = false;
+		lasershark_ringbuffer_tail = lasershark_ringbuffer_head;
+		lasershark_control_head = lasershark_control_tail; // Their samples are gone
+		lasershark_blank = false;
+		lasershark_ringbuffer_room_wanted = 0; // A held packet is loaded instead
+		__enable_irq();
+	}
+	lasershark_frame_back = lasershark_frame_playing && lasershark_frame_start
+			< LASERSHARK_FRAME_SAMPLES ? LASERSHARK_FRAME_SAMPLES : 0;
+	lasershark_frame_loaded = 0;
+	lasershark_frame_loading = true;
+	return true;
+}
+
+static bool lasershark_set_data_format(uint32_t format)
+{
+	if (format != LASERSHARK_DATA_RAW && format != LASERSHARK_DATA_COMPRESSED) {
+		return false;
+	}
+	lasershark_data_format = format;
+	lasershark_decode_ba = 0;
+	lasershark_decode_yx = DAC124S085_DAC_VAL_MID << 16 | DAC124S085_DAC_VAL_MID;
+	lasershark_line_step = LASERSHARK_PACK_STEP_DEFAULT;
+	lasershark_line_dwell = LASERSHARK_PACK_DWELL_DEFAULT;
+	lasershark_line_done = 0;
+	USB_DropData();
+	return true;
+}
+
+static bool lasershark_set_transform(const int32_t *matrix)
+{
+	if (matrix[8] <= 0) {
+		return false;
+	}
+	memcpy(lasershark_transform, matrix, sizeof(lasershark_transform));
+	if (matrix[6] || matrix[7] || matrix[8] != LASERSHARK_TRANSFORM_ONE) {
+		lasershark_transform_kind = LASERSHARK_TRANSFORM_PROJECTIVE;
+	} else if (matrix[0] != LASERSHARK_TRANSFORM_ONE || matrix[1] || matrix[2]
+			|| matrix[3] || matrix[4] != LASERSHARK_TRANSFORM_ONE || matrix[5]) {
+		lasershark_transform_kind = LASERSHARK_TRANSFORM_AFFINE;
+	} else {
+		lasershark_transform_kind = LASERSHARK_TRANSFORM_NONE;
+	}
+	return true;
+}
+
+// Sets count warp mesh points from first to the offsets at data.
+static bool lasershark_set_warp(uint32_t first, uint32_t count, const unsigned char *data)
+{
+	struct lasershark_warp_point point;
+	uint32_t n;
+
+	if (count > LASERSHARK_WARP_POINTS_PER_CMD || first + count
+			> LASERSHARK_WARP_SIZE_MAX * LASERSHARK_WARP_SIZE_MAX) {
+		return false;
+	}
+	for (n = 0; n < count; n++) {
+		memcpy(&point, data + n * sizeof(point), sizeof(point));
+		if (point.dx < -DAC124S085_DAC_VAL_MAX || point.dx > DAC124S085_DAC_VAL_MAX
+				|| point.dy < -DAC124S085_DAC_VAL_MAX || point.dy
+				> DAC124S085_DAC_VAL_MAX) {
+			return false;
+		}
+	}
+	lasershark_warp_size = 0;
+	memcpy(lasershark_warp_mesh + first, data, count * sizeof(point));
+	return true;
+}
+
+static bool lasershark_warp_enable(uint32_t size)
+{
+	// The cells must be a power of two wide to be found with a shift.
+	if (size && (size < 2 || size > LASERSHARK_WARP_SIZE_MAX || ((size - 1)
+			& (size - 2)))) {
+		return false;
+	}
+	lasershark_warp_size = size;
+	lasershark_warp_shift = size ? 12 - (31 - __CLZ(size - 1)) : 0;
+	return true;
+}
+
+// Where the straight curve has point i.
+static uint32_t lasershark_gamma_straight(uint32_t i)
+{
+	return i << LASERSHARK_GAMMA_SHIFT < DAC124S085_DAC_VAL_MAX ? i
+			<< LASERSHARK_GAMMA_SHIFT : DAC124S085_DAC_VAL_MAX;
+}
+
+// Sets a channel's curve to the points at data.
+static bool lasershark_set_gamma(uint32_t channel, const unsigned char *data)
+{
+	uint16_t point;
+	uint32_t i, j;
+
+	if (channel >= LASERSHARK_GAMMA_CHANNELS) {
+		return false;
+	}
+	for (i = 0; i < LASERSHARK_GAMMA_POINTS; i++) {
+		memcpy(&point, data + i * sizeof(point), sizeof(point));
+		if (point > DAC124S085_DAC_VAL_MAX) {
+			return false;
+		}
+	}
+	memcpy(lasershark_gamma[channel], data, sizeof(lasershark_gamma[0]));
+	j = 0;
+	for (i = 0; i < LASERSHARK_GAMMA_POINTS; i++) {
+		if (lasershark_gamma[channel][i] != lasershark_gamma_straight(i)) {
+			j = 1 << channel;
+		}
+	}
+	lasershark_gamma_on = (lasershark_gamma_on & ~(1 << channel)) | j;
+	return true;
+}
+
+// Sets the A, B, C and INTL_A delays to the bytes at delays.
+static bool lasershark_set_delays(const unsigned char *delays)
+{
+	uint32_t n, most = 0;
+
+	for (n = 0; n < 4; n++) {
+		if (delays[n] > LASERSHARK_DELAY_MAX) {
+			return false;
+		}
+		if (delays[n] > most) {
+			most = delays[n];
+		}
+	}
+	// Data packets are read in the USB interrupt as well, so the reservation
+	// holds from the next one on. The output has nothing it can delay by
+	// until it has played the samples since.
+	lasershark_ringbuffer_reserved = most;
+	lasershark_delay_played = 0;
+	lasershark_delays = delays[0] | delays[1] << 8 | delays[2] << 16
+			| delays[3] << 24;
+	return true;
 }
 
 bool lasershark_set_ilda_rate(uint32_t ilda_rate) {
+	uint64_t nominal;
+	uint32_t tc;
+
 	if (ilda_rate > lasershark_ilda_rate_max || ilda_rate == 0) {
 		return false;
 	}
-	lasershark_curr_ilda_rate = ilda_rate;
 	// Remember ILDA rate will be 1/2 Frequency (i.e. 50Khz = 100Kpps)
-	lasershark_core_duration = SystemCoreClock / lasershark_curr_ilda_rate - 1;
+	nominal = (((uint64_t) SystemCoreClock << 16) + ilda_rate / 2) / ilda_rate;
+	__disable_irq(); // The output can change the rate too
+	lasershark_curr_ilda_rate = ilda_rate;
+	lasershark_nominal_period = nominal;
+	__enable_irq();
+	lasershark_set_trim(lasershark_clock_trim || lasershark_servo ?
+			lasershark_trim_ppb : 0);
 
+	// Start the new rate afresh: count the clocks of a period the new match
+	// cuts short, drop the fraction of a clock owed to the old periods and
+	// throw away the drift window measured against them.
+	__disable_irq();
+	tc = LPC_CT32B1->TC;
 	update_timer32(1, lasershark_core_duration);
+	if (tc > lasershark_core_duration) {
+		lasershark_core_clocks += tc - lasershark_core_duration;
+	}
+	lasershark_core_duration_acc = 0;
+	lasershark_rate_changed = true;
+	__enable_irq();
 
 	return true;
 }
 
-__inline uint32_t lasershark_get_empty_sample_count()
+// Like lasershark_get_empty_sample_count(), but counting the samples kept for delayed colour.
+LASERSHARK_HOT_INLINE uint32_t lasershark_get_free_sample_count()
 {
 	return ((lasershark_ringbuffer_head > lasershark_ringbuffer_tail) ?
 					lasershark_ringbuffer_head - lasershark_ringbuffer_tail :
 					LASERSHARK_RINGBUFFER_SAMPLES - lasershark_ringbuffer_tail + lasershark_ringbuffer_head);
 }
 
+LASERSHARK_HOT_PATH __inline uint32_t lasershark_get_empty_sample_count()
+{
+	uint32_t empty = lasershark_get_free_sample_count();
+
+	// Never less than one, which is the ring buffer full.
+	return empty > lasershark_ringbuffer_reserved ? empty
+			- lasershark_ringbuffer_reserved : 1;
+}
+
+// What the host is told is unfilled: in frame loop mode, the room left in the back frame.
+static uint32_t lasershark_get_reported_empty_count()
+{
+	if (lasershark_frame_mode) {
+		return lasershark_frame_loading ? LASERSHARK_FRAME_SAMPLES
+				- lasershark_frame_loaded : 0;
+	}
+	return lasershark_get_empty_sample_count();
+}
+
+// Clamps a trim in parts per billion to within LASERSHARK_DRIFT_PPB_MAX.
+static int32_t lasershark_clamp_ppb(int64_t ppb)
+{
+	if (ppb > LASERSHARK_DRIFT_PPB_MAX) {
+		return LASERSHARK_DRIFT_PPB_MAX;
+	}
+	if (ppb < -LASERSHARK_DRIFT_PPB_MAX) {
+		return -LASERSHARK_DRIFT_PPB_MAX;
+	}
+	return ppb;
+}
+
+/*
+ * Speeds the ILDA clock up by trim_ppb parts per billion from the current
+ * rate's nominal sample period (slows it down if negative), within
+ * LASERSHARK_DRIFT_PPB_MAX.
+ */
+static void lasershark_set_trim(int32_t trim_ppb)
+{
+	uint64_t nominal, period;
+
+	trim_ppb = lasershark_clamp_ppb(trim_ppb);
+	for (;;) {
+		nominal = lasershark_nominal_period;
+		period = nominal - (int64_t) nominal * trim_ppb / 1000000000;
+		__disable_irq();
+		if (nominal == lasershark_nominal_period) {
+			break;
+		}
+		__enable_irq(); // A control word changed the rate meanwhile
+	}
+
+	lasershark_trim_ppb = trim_ppb;
+	lasershark_core_duration_frac = (uint32_t) period << 16;
+	lasershark_core_duration = (period >> 16) - 1;
+	__enable_irq();
+}
+
+// The sample period in force, trim included, in 1/65536ths of a clock.
+static uint64_t lasershark_get_period()
+{
+	return ((uint64_t) (lasershark_core_duration + 1) << 16)
+			| lasershark_core_duration_frac >> 16;
+}
+
+/*
+ * Core clocks CT32B1 has counted, wrapping: those of the sample periods played
+ * plus how far into the current one it is. Call with interrupts disabled.
+ */
+static uint32_t lasershark_get_core_clocks()
+{
+	uint32_t clocks, tc;
+
+	clocks = lasershark_core_clocks;
+	tc = LPC_CT32B1->TC;
+	if (LPC_CT32B1->IR & 1) { // The period has ended, but the interrupt has not counted it yet.
+		clocks += LPC_CT32B1->MR0 + 1;
+		tc = LPC_CT32B1->TC;
+	}
+	return clocks + tc;
+}
+
+/*
+ * Works out the drift over a window of frames USB frames, in which CT32B1
+ * counted clocks core clocks of period at rate, and takes half of it off the trim if asked to. Windows more than LASERSHARK_DRIFT_PPB_MAX out, such as one the
+ * host stopped sending frames in, are ignored.
+ */
+static void lasershark_measure_drift(uint32_t clocks, uint32_t frames,
+		uint64_t period, uint32_t rate)
+{
+	uint64_t played = ((uint64_t) clocks << 32) / period; // In 1/65536ths of a sample
+	uint64_t expected = ((uint64_t) rate * frames << 16)
+			/ LASERSHARK_USB_SOF_RATE;
+	uint64_t nominal = (uint64_t) SystemCoreClock * frames
+			/ LASERSHARK_USB_SOF_RATE;
+	int32_t drift = ((int64_t) played - (int64_t) expected) * 1000000
+			/ (int64_t) (expected / 1000);
+	int32_t crystal = ((int64_t) clocks - (int64_t) nominal) * 1000000
+			/ (int64_t) (nominal / 1000);
+
+	if (drift > LASERSHARK_DRIFT_PPB_MAX || drift < -LASERSHARK_DRIFT_PPB_MAX
+			|| crystal > LASERSHARK_DRIFT_PPB_MAX || crystal
+			< -LASERSHARK_DRIFT_PPB_MAX) {
+		return;
+	}
+
+	if (lasershark_drift_windows++) {
+		lasershark_drift_ppb += (drift - lasershark_drift_ppb) / 8;
+		lasershark_crystal_ppb += (crystal - lasershark_crystal_ppb) / 8;
+	} else {
+		lasershark_drift_ppb = drift;
+		lasershark_crystal_ppb = crystal;
+	}
+
+	if (lasershark_clock_trim) {
+		lasershark_set_trim(lasershark_trim_ppb - drift / 2);
+	}
+}
+
+/*
+ * Trims the ILDA clock by a PI controller on how far the ring buffer is off
+ * its target fill: faster when too full, slower when too empty. Only runs
+ * while samples are being played, so the integral holds while they are not.
+ */
+static void lasershark_run_servo()
+{
+	// The samples kept back for delayed colour are still queued.
+	int32_t error = (int32_t) (LASERSHARK_RINGBUFFER_SAMPLES - 1
+			- lasershark_get_free_sample_count())
+			- (int32_t) lasershark_servo_target;
+
+	if (!lasershark_output_enabled || lasershark_underrun
+			|| lasershark_frame_mode) {
+		return;
+	}
+	lasershark_servo_integral = lasershark_clamp_ppb(lasershark_servo_integral
+			+ (int64_t) error * lasershark_servo_ki * LASERSHARK_SERVO_FRAMES
+					/ LASERSHARK_USB_SOF_RATE);
+	lasershark_set_trim(lasershark_clamp_ppb((int64_t) error
+			* lasershark_servo_kp + lasershark_servo_integral));
+}
+
+/*
+ * Called on every USB start of frame. Every LASERSHARK_DRIFT_WINDOW_FRAMES
+ * frames the clocks CT32B1 counted are checked against the frames' 1 ms, and
+ * every LASERSHARK_SERVO_FRAMES frames the servo runs if it is on.
+ */
+void lasershark_usb_sof()
+{
+	uint32_t clocks, rate, frame, frames;
+	uint64_t period;
+	bool changed;
+
+	// A control word can change the rate from the output interrupt, so take
+	// the clocks and the rate they were counted at together.
+	__disable_irq();
+	clocks = lasershark_get_core_clocks();
+	period = lasershark_get_period();
+	rate = lasershark_curr_ilda_rate;
+	changed = lasershark_rate_changed;
+	lasershark_rate_changed = false;
+	__enable_irq();
+	frame = LPC_USB->INFO & LASERSHARK_USB_FRAME_NR_MASK;
+	frames = (frame - lasershark_drift_window_frame)
+			& LASERSHARK_USB_FRAME_NR_MASK;
+
+	if (lasershark_servo && !lasershark_servo_countdown--) {
+		lasershark_servo_countdown = LASERSHARK_SERVO_FRAMES - 1;
+		lasershark_run_servo();
+	}
+
+	if (lasershark_drift_window_open && !changed) {
+		if (frames < LASERSHARK_DRIFT_WINDOW_FRAMES) {
+			return;
+		}
+		lasershark_measure_drift(clocks - lasershark_drift_window_clocks,
+				frames, period, rate);
+	}
+	lasershark_drift_window_open = true;
+	lasershark_drift_window_frame = frame;
+	lasershark_drift_window_clocks = clocks;
+}
+
+void lasershark_clear_stats()
+{
+	lasershark_stats.underrun_events = 0;
+	lasershark_stats.underrun_samples = 0;
+	lasershark_stats.underrun_frame = 0;
+	lasershark_stats.overrun_samples = 0;
+	lasershark_stats.overrun_frame = 0;
+	lasershark_stats.isr_latency_max = 0;
+	lasershark_stats.low_water = LASERSHARK_RINGBUFFER_SAMPLES - 1;
+	lasershark_stats.control_dropped = 0;
+	lasershark_stats.decode_errors = 0;
+}
+
+// Fills in the record endpoint 2 pushes to the host.
+void lasershark_get_status(struct lasershark_status *status)
+{
+	status->frame = LPC_USB->INFO & LASERSHARK_USB_FRAME_NR_MASK;
+	status->empty_samples = lasershark_get_reported_empty_count();
+	status->underrun_events = lasershark_stats.underrun_events;
+	status->overrun_samples = lasershark_stats.overrun_samples;
+	status->drift_ppb = lasershark_drift_ppb;
+	status->trim_ppb = lasershark_trim_ppb;
+	status->sync_count = lasershark_sync_count;
+	status->output_enabled = lasershark_output_enabled;
+	status->interlock_b = lasershark_get_interlock_b();
+	status->blank = lasershark_blank;
+	status->reserved = 0;
+}
+
+/*
+ * Packs a sample into the ring buffer at index i. Samples are sent as two big
+ * endian words, given here as read: B in the top half of ba with A, INTL_A
+ * (bit 15) and C (bit 14) below it, and Y in the top half of yx with X below.
+ */
+static __INLINE void lasershark_put_sample(uint32_t i, uint32_t ba, uint32_t yx)
+{
+	uint32_t shift = (i % 4) * 2;
+
+	lasershark_ringbuffer_xya[i] = (yx & DAC124S085_INPUT_REG_DATA_MASK)
+			| ((yx >> (16 - LASERSHARK_XYA_Y_SHIFT))
+					& (DAC124S085_INPUT_REG_DATA_MASK << LASERSHARK_XYA_Y_SHIFT))
+			| (ba & LASERSHARK_XYA_A_MASK) << LASERSHARK_XYA_A_SHIFT;
+	lasershark_ringbuffer_b[i] = ba >> (16 + LASERSHARK_B_SHIFT);
+	lasershark_ringbuffer_ab_low[i] = (ba & LASERSHARK_AB_LOW_MASK) | ((ba
+			>> (16 - LASERSHARK_AB_LOW_B_SHIFT)) & (LASERSHARK_AB_LOW_MASK
+			<< LASERSHARK_AB_LOW_B_SHIFT));
+	lasershark_ringbuffer_pins[i / 4] = (lasershark_ringbuffer_pins[i / 4] & ~(3
+			<< shift)) | ((ba >> LASERSHARK_PINS_SHIFT) & 3) << shift;
+}
+
+// Queues a control word for the output to act on when it reaches index i.
+static void lasershark_put_control(uint32_t i, uint32_t op, uint32_t arg)
+{
+	uint32_t tail = lasershark_control_tail;
+	uint32_t next = (tail + 1) % LASERSHARK_CONTROL_QUEUE_SIZE;
+
+	if (next == lasershark_control_head || lasershark_frame_mode
+			|| (op != LASERSHARK_CONTROL_RATE
+			&& op != LASERSHARK_CONTROL_BLANK && op != LASERSHARK_CONTROL_SYNC)
+			|| (op == LASERSHARK_CONTROL_RATE && (arg == 0 || arg
+					> lasershark_ilda_rate_max))) {
+		lasershark_stats.control_dropped++;
+		return;
+	}
+	lasershark_controls[tail].index = i;
+	lasershark_controls[tail].op = op;
+	lasershark_controls[tail].arg = arg;
+	lasershark_control_tail = next;
+}
+
+/*
+ * Gets where data packets put their samples and returns how many fit: after
+ * the last sample in the ring buffer or, in frame loop mode, after the last
+ * in the back frame if one is being loaded.
+ */
+static __INLINE uint32_t lasershark_get_ingest(uint32_t *tail)
+{
+	if (lasershark_frame_mode) {
+		*tail = lasershark_frame_back + lasershark_frame_loaded;
+		return lasershark_frame_loading ? LASERSHARK_FRAME_SAMPLES
+				- lasershark_frame_loaded : 0;
+	}
+	*tail = lasershark_ringbuffer_tail;
+	return lasershark_get_empty_sample_count() - 1;
+}
+
+// Marks the samples up to tail as added, see lasershark_get_ingest().
+static __INLINE void lasershark_set_ingest(uint32_t tail)
+{
+	if (lasershark_frame_mode) {
+		lasershark_frame_loaded = (tail + LASERSHARK_RINGBUFFER_SAMPLES
+				- lasershark_frame_back) % LASERSHARK_RINGBUFFER_SAMPLES;
+	} else {
+		lasershark_ringbuffer_tail = tail;
+	}
+}
+
+/*
+ * Rounds n / d to a whole offset from DAC124S085_DAC_VAL_MID that stays in
+ * the DAC range, d being positive, with the one 32 bit division the core has.
+ */
+static int32_t lasershark_project(int64_t n, int64_t d)
+{
+	uint32_t bits;
+	int32_t q;
+
+	if (n >= d << 11) {
+		return DAC124S085_DAC_VAL_MAX - DAC124S085_DAC_VAL_MID;
+	}
+	if (n <= -(d << 11)) {
+		return DAC124S085_DAC_VAL_MIN - DAC124S085_DAC_VAL_MID;
+	}
+	if (d == LASERSHARK_TRANSFORM_ONE) { // Affine
+		q = (int32_t) (n + LASERSHARK_TRANSFORM_ONE / 2) >> 16;
+	} else {
+		// |n| < d * 2^11, so with d cut to 19 bits n fits in 31 and the
+		// quotient is out by under 1/64.
+		bits = d >> 32 ? 64 - __CLZ(d >> 32) : 32 - __CLZ(d);
+		if (bits > 19) {
+			n >>= bits - 19;
+			d >>= bits - 19;
+		}
+		q = ((int32_t) n + (n < 0 ? -(int32_t) d : (int32_t) d) / 2) / (int32_t) d;
+	}
+	if (q > DAC124S085_DAC_VAL_MAX - DAC124S085_DAC_VAL_MID) {
+		q = DAC124S085_DAC_VAL_MAX - DAC124S085_DAC_VAL_MID;
+	} else if (q < DAC124S085_DAC_VAL_MIN - DAC124S085_DAC_VAL_MID) {
+		q = DAC124S085_DAC_VAL_MIN - DAC124S085_DAC_VAL_MID;
+	}
+	return q;
+}
+
+// Puts a sample's X and Y, given as Y << 16 | X, through the transform.
+static uint32_t lasershark_apply_transform(uint32_t yx)
+{
+	const int32_t *m = lasershark_transform;
+	int32_t u = (int32_t) (yx & DAC124S085_INPUT_REG_DATA_MASK) - DAC124S085_DAC_VAL_MID;
+	int32_t v = (int32_t) (yx >> 16 & DAC124S085_INPUT_REG_DATA_MASK) - DAC124S085_DAC_VAL_MID;
+	int64_t x = (int64_t) m[0] * u + (int64_t) m[1] * v + m[2];
+	int64_t y = (int64_t) m[3] * u + (int64_t) m[4] * v + m[5];
+	int64_t w;
+
+	if (lasershark_transform_kind == LASERSHARK_TRANSFORM_AFFINE) {
+		w = LASERSHARK_TRANSFORM_ONE;
+	} else {
+		w = (int64_t) m[6] * u + (int64_t) m[7] * v + m[8];
+		if (w <= 0) {
+			w = 1; // Past the horizon; the point goes to the edge
+		}
+	}
+	return (uint32_t) (DAC124S085_DAC_VAL_MID + lasershark_project(x, w))
+			| (uint32_t) (DAC124S085_DAC_VAL_MID + lasershark_project(y, w)) << 16;
+}
+
+static __INLINE uint32_t lasershark_clamp_dac(int32_t val)
+{
+	if (val < DAC124S085_DAC_VAL_MIN) {
+		return DAC124S085_DAC_VAL_MIN;
+	}
+	return val > DAC124S085_DAC_VAL_MAX ? DAC124S085_DAC_VAL_MAX : val;
+}
+
+// Interpolates from a to b, f being how far along in 1/2^shifths.
+static __INLINE int32_t lasershark_lerp(int32_t a, int32_t b, uint32_t f, uint32_t shift)
+{
+	return a + (((b - a) * (int32_t) f + (1 << (shift - 1))) >> shift);
+}
+
+// Moves a sample's X and Y, given as Y << 16 | X, by the warp mesh.
+static uint32_t lasershark_apply_warp(uint32_t yx)
+{
+	uint32_t shift = lasershark_warp_shift, mask = (1 << shift) - 1;
+	uint32_t x = yx & DAC124S085_INPUT_REG_DATA_MASK;
+	uint32_t y = yx >> 16 & DAC124S085_INPUT_REG_DATA_MASK;
+	const struct lasershark_warp_point *top = lasershark_warp_mesh + (y >> shift)
+			* lasershark_warp_size + (x >> shift);
+	const struct lasershark_warp_point *bottom = top + lasershark_warp_size;
+	struct lasershark_warp_point tl = top[0], tr = top[1], bl = bottom[0],
+			br = bottom[1];
+	int32_t dx, dy;
+
+	dx = lasershark_lerp(lasershark_lerp(tl.dx, tr.dx, x & mask, shift),
+			lasershark_lerp(bl.dx, br.dx, x & mask, shift), y & mask, shift);
+	dy = lasershark_lerp(lasershark_lerp(tl.dy, tr.dy, x & mask, shift),
+			lasershark_lerp(bl.dy, br.dy, x & mask, shift), y & mask, shift);
+	return lasershark_clamp_dac((int32_t) x + dx) | lasershark_clamp_dac((int32_t) y + dy) << 16;
+}
+
+// Maps a 12 bit value through a curve.
+static __INLINE uint32_t lasershark_gamma_lookup(const uint16_t *curve, uint32_t val)
+{
+	const uint16_t *p = curve + (val >> LASERSHARK_GAMMA_SHIFT);
+
+	return p[0] + ((((int32_t) p[1] - p[0]) * (int32_t) (val & ((1
+			<< LASERSHARK_GAMMA_SHIFT) - 1)) + (1 << (LASERSHARK_GAMMA_SHIFT - 1)))
+			>> LASERSHARK_GAMMA_SHIFT);
+}
+
+// Puts a sample's A and B, given as B << 16 | A with INTL_A and C, through their curves.
+static __INLINE uint32_t lasershark_map_colour(uint32_t ba)
+{
+	uint32_t on = lasershark_gamma_on;
+	uint32_t a = ba & DAC124S085_INPUT_REG_DATA_MASK;
+	uint32_t b = ba >> 16 & DAC124S085_INPUT_REG_DATA_MASK;
+
+	if (!on) {
+		return ba;
+	}
+	if (on & 1) {
+		a = lasershark_gamma_lookup(lasershark_gamma[0], a);
+	}
+	if (on & 2) {
+		b = lasershark_gamma_lookup(lasershark_gamma[1], b);
+	}
+	return (ba & 3 << LASERSHARK_PINS_SHIFT) | a | b << 16;
+}
+
+// Puts a sample's X and Y through the transform and the warp, if set.
+static __INLINE uint32_t lasershark_transform_point(uint32_t yx)
+{
+	if (lasershark_transform_kind != LASERSHARK_TRANSFORM_NONE) {
+		yx = lasershark_apply_transform(yx);
+	}
+	if (lasershark_warp_size) {
+		yx = lasershark_apply_warp(yx);
+	}
+	return yx;
+}
+
+/*
+ * Packs the samples of a data packet of cnt bytes into the ring buffer. The
+ * packet must be word aligned. A trailing partial sample is dropped, as are
+ * samples the ring buffer has no room for rather than overwriting ones yet to
+ * be played.
+ */
 __inline void lasershark_process_data(unsigned char* packet, uint32_t cnt) {
-	uint32_t dat, n, cntmod = (cnt + 3) / 4;
-	uint32_t *pData;
+	uint32_t n, samples = cnt / (LASERSHARK_ILDA_CHANNELS * sizeof(uint16_t));
+	uint32_t *pData = (uint32_t *) packet;
+	uint32_t tail, room = lasershark_get_ingest(&tail);
+	uint32_t ba, yx;
 
 	GPIOToggleValue(LED_PORT, USR2_LED_BIT);
 
-	for (n = 0; n < cntmod; n++) {
-		dat = 	(packet[n*4 + 0] << 24) +
-				(packet[n*4 + 1] << 16) +
-				(packet[n*4 + 2] << 8 ) +
-				(packet[n*4 + 3] << 0 );
-
-		pData
-				= ((uint32_t __attribute__((packed)) *) lasershark_ringbuffer[lasershark_ringbuffer_tail]);
-		if (n % 2) { // Odd
-			pData[1] = dat;
-			lasershark_ringbuffer_tail = (lasershark_ringbuffer_tail + 1)
-					% LASERSHARK_RINGBUFFER_SAMPLES;
-		} else { // Even
-			pData[0] = dat;
+	for (n = 0; n < samples; n++, pData += 2) {
+		ba = __REV(pData[0]);
+		yx = __REV(pData[1]);
+		if ((yx & LASERSHARK_CONTROL_MARK) == LASERSHARK_CONTROL_MARK) {
+			lasershark_put_control(tail, yx & DAC124S085_INPUT_REG_DATA_MASK, ba);
+			continue;
+		}
+		if (!room) {
+			lasershark_stats.overrun_samples++;
+			lasershark_stats.overrun_frame = LPC_USB->INFO
+					& LASERSHARK_USB_FRAME_NR_MASK;
+			continue;
+		}
+		room--;
+		lasershark_put_sample(tail, lasershark_map_colour(ba),
+				lasershark_transform_point(yx));
+		if (++tail == LASERSHARK_RINGBUFFER_SAMPLES) {
+			tail = 0;
 		}
 	}
+	lasershark_set_ingest(tail);
 }
 
-void CT32B1_IRQHandler(void) {
-	LPC_CT32B1->IR = 1; /* clear interrupt flag */
+static __INLINE uint32_t lasershark_get_be32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+/*
+ * Decodes cnt bytes of a LASERSHARK_DATA_COMPRESSED data packet into the ring
+ * buffer and returns how many it used. With hold set it stops at the first
+ * sample the ring buffer has no room for, or after LASERSHARK_DECODE_SAMPLES_MAX,
+ * rewriting a repeat cut short in the packet to the repeats still owed, or
+ * leaving a line cut short at the samples made so far, so the rest can be
+ * decoded later; otherwise samples that do not fit are dropped as
+ * by lasershark_process_data().
+ */
+uint32_t lasershark_decode_data(unsigned char *packet, uint32_t cnt, bool hold)
+{
+	uint32_t tail, room = lasershark_get_ingest(&tail);
+	uint32_t ba = lasershark_decode_ba, yx = lasershark_decode_yx;
+	uint32_t i = 0, op, len, run, v, from, steps, left, k, colour, point;
+	int32_t dx, dy;
+
+	GPIOToggleValue(LED_PORT, USR2_LED_BIT);
+
+	if (hold && room > LASERSHARK_DECODE_SAMPLES_MAX) {
+		room = LASERSHARK_DECODE_SAMPLES_MAX;
+	}
+	while (i < cnt) {
+		op = packet[i];
+		switch (op & LASERSHARK_PACK_OP_MASK) {
+		case LASERSHARK_PACK_DELTA:
+			len = 2;
+			break;
+		case LASERSHARK_PACK_DELTA_LONG:
+			len = 3;
+			break;
+		case LASERSHARK_PACK_REPEAT:
+			len = 1;
+			break;
+		default:
+			switch (op) {
+			case LASERSHARK_PACK_SAMPLE:
+				len = 9;
+				break;
+			case LASERSHARK_PACK_COLOUR:
+			case LASERSHARK_PACK_LINE:
+			case LASERSHARK_PACK_MOVE:
+				len = 5;
+				break;
+			case LASERSHARK_PACK_STEP:
+				len = 4;
+				break;
+			default:
+				len = cnt + 1;
+				break;
+			}
+			break;
+		}
+		if (i + len > cnt) { // Unknown or truncated
+			lasershark_stats.decode_errors++;
+			i = cnt;
+			break;
+		}
+
+		dx = 0;
+		dy = 0;
+		run = 1;
+		if (len == 2) {
+			v = (op & ~LASERSHARK_PACK_OP_MASK) << 8 | packet[i + 1];
+			dx = (int32_t) (v << 18) >> 25;
+			dy = (int32_t) (v << 25) >> 25;
+		} else if (len == 3) {
+			v = (op & ~LASERSHARK_PACK_OP_MASK) << 16 | packet[i + 1] << 8
+					| packet[i + 2];
+			dx = (int32_t) (v << 10) >> 21;
+			dy = (int32_t) (v << 21) >> 21;
+		} else if (len == 1) {
+			run = (op & ~LASERSHARK_PACK_OP_MASK) + 1;
+		}
+		if (op == LASERSHARK_PACK_COLOUR) {
+			ba = lasershark_get_be32(packet + i + 1);
+			i += len;
+			continue;
+		}
+		if (op == LASERSHARK_PACK_STEP) {
+			v = packet[i + 1] << 8 | packet[i + 2];
+			if (!v) {
+				lasershark_stats.decode_errors++;
+				i = cnt;
+				break;
+			}
+			lasershark_line_step = v;
+			lasershark_line_dwell = packet[i + 3];
+			i += len;
+			continue;
+		}
+		if (op == LASERSHARK_PACK_LINE || op == LASERSHARK_PACK_MOVE) {
+			// A line cut short carries on from where it started, so where
+			// the ring buffer filled up makes no odds to its samples.
+			if (!lasershark_line_done) {
+				lasershark_line_from = yx;
+			}
+			from = lasershark_line_from;
+			v = lasershark_get_be32(packet + i + 1);
+			dx = (int32_t) (v & DAC124S085_INPUT_REG_DATA_MASK)
+					- (int32_t) (from & DAC124S085_INPUT_REG_DATA_MASK);
+			dy = (int32_t) (v >> 16 & DAC124S085_INPUT_REG_DATA_MASK)
+					- (int32_t) (from >> 16 & DAC124S085_INPUT_REG_DATA_MASK);
+			steps = dx < 0 ? -dx : dx;
+			k = dy < 0 ? -dy : dy;
+			if (k > steps) {
+				steps = k;
+			}
+			steps = (steps + lasershark_line_step - 1) / lasershark_line_step;
+			if (!steps) {
+				steps = 1;
+			}
+			// Per step, in 1/65536ths. What truncating it loses adds up to
+			// under 1/16 over the most steps a line takes, so the last step
+			// rounds to the end point.
+			dx = (dx << 16) / (int32_t) steps;
+			dy = (dy << 16) / (int32_t) steps;
+
+			left = steps + lasershark_line_dwell - lasershark_line_done;
+			run = left > room ? room : left;
+			if (run < left && !hold) {
+				lasershark_stats.overrun_samples += left - run;
+				lasershark_stats.overrun_frame = LPC_USB->INFO
+						& LASERSHARK_USB_FRAME_NR_MASK;
+			}
+			room -= run;
+			// A move stays dark whatever the curves map 0 to.
+			colour = op == LASERSHARK_PACK_MOVE ? ba & 3 << LASERSHARK_PINS_SHIFT
+					: lasershark_map_colour(ba);
+			while (run--) {
+				k = ++lasershark_line_done < steps ? lasershark_line_done : steps;
+				yx = ((from & DAC124S085_INPUT_REG_DATA_MASK)
+						+ (uint32_t) (((int32_t) k * dx + 0x8000) >> 16))
+						| ((from >> 16 & DAC124S085_INPUT_REG_DATA_MASK)
+								+ (uint32_t) (((int32_t) k * dy + 0x8000) >> 16)) << 16;
+				lasershark_put_sample(tail, colour, lasershark_transform_point(yx));
+				if (++tail == LASERSHARK_RINGBUFFER_SAMPLES) {
+					tail = 0;
+				}
+			}
+			if (hold && lasershark_line_done < steps + lasershark_line_dwell) {
+				break; // Left for later
+			}
+			lasershark_line_done = 0;
+			yx = v & (DAC124S085_INPUT_REG_DATA_MASK << 16 | DAC124S085_INPUT_REG_DATA_MASK);
+			i += len;
+			continue;
+		}
+		if (op == LASERSHARK_PACK_SAMPLE) {
+			v = lasershark_get_be32(packet + i + 5);
+			if ((v & LASERSHARK_CONTROL_MARK) == LASERSHARK_CONTROL_MARK) {
+				lasershark_put_control(tail, v & DAC124S085_INPUT_REG_DATA_MASK,
+						lasershark_get_be32(packet + i + 1));
+				i += len;
+				continue;
+			}
+		}
+
+		if (run > room) {
+			if (hold) {
+				if (!room) {
+					break;
+				}
+				// Play what fits now and leave the rest of the run.
+				packet[i] = LASERSHARK_PACK_REPEAT | (run - room - 1);
+				run = room;
+				len = 0;
+			} else {
+				lasershark_stats.overrun_samples += run - room;
+				lasershark_stats.overrun_frame = LPC_USB->INFO
+						& LASERSHARK_USB_FRAME_NR_MASK;
+				run = room;
+			}
+		}
+		if (op == LASERSHARK_PACK_SAMPLE) {
+			ba = lasershark_get_be32(packet + i + 1);
+			yx = lasershark_get_be32(packet + i + 5);
+		} else {
+			yx = ((yx + dx) & DAC124S085_INPUT_REG_DATA_MASK) | ((yx + ((uint32_t) dy
+					<< 16)) & DAC124S085_INPUT_REG_DATA_MASK << 16);
+		}
+		i += len;
+		room -= run;
+		colour = lasershark_map_colour(ba);
+		point = lasershark_transform_point(yx);
+		while (run--) {
+			lasershark_put_sample(tail, colour, point);
+			if (++tail == LASERSHARK_RINGBUFFER_SAMPLES) {
+				tail = 0;
+			}
+		}
+	}
+	lasershark_set_ingest(tail);
+	lasershark_decode_ba = ba;
+	lasershark_decode_yx = yx;
+	return i;
+}
+
+// Acts on a control word the output has reached.
+static void lasershark_apply_control(volatile const struct lasershark_control *control)
+{
+	switch (control->op) {
+	case LASERSHARK_CONTROL_RATE:
+#if (LASERSHARK_DAC_TIMED_UPDATE)
+		// The sample it comes before is only preloaded now and is drawn on
+		// the next tick, whose period is the first to take the new rate.
+		lasershark_dac_update_rate = control->arg;
+#else
+		lasershark_set_ilda_rate(control->arg);
+#endif
+		break;
+	case LASERSHARK_CONTROL_BLANK:
+		lasershark_blank = control->arg;
+		break;
+	case LASERSHARK_CONTROL_SYNC:
+		lasershark_sync_marker = control->arg;
+		lasershark_sync_frame = LPC_USB->INFO & LASERSHARK_USB_FRAME_NR_MASK;
+		lasershark_sync_count++;
+		break;
+	}
+}
+
+// Makes the back frame the front one.
+LASERSHARK_HOT_INLINE void lasershark_take_frame(void) {
+	lasershark_frame_start = lasershark_frame_back;
+	lasershark_frame_end = (lasershark_frame_back + lasershark_frame_loaded)
+			% LASERSHARK_RINGBUFFER_SAMPLES;
+	lasershark_frame_playing = true;
+	lasershark_frame_swap = false;
+}
+
+/*
+ * Gets the index of the sample delay before the one at head, which is since
+ * samples into what is being played, or LASERSHARK_RINGBUFFER_SAMPLES if there
+ * is none. What is being played wraps round to its own end if it is a looped
+ * frame of len samples.
+ */
+LASERSHARK_HOT_INLINE uint32_t lasershark_delayed_index(uint32_t head, uint32_t delay,
+		uint32_t since, uint32_t len)
+{
+	if (delay <= since) {
+		return head >= delay ? head - delay : head
+				+ LASERSHARK_RINGBUFFER_SAMPLES - delay;
+	}
+	// A frame lies within one half of the ring buffer, so this cannot wrap.
+	return delay <= len ? head + len - delay : LASERSHARK_RINGBUFFER_SAMPLES;
+}
+
+/*
+ * Gets the A, B and pin levels to go out with the position of the sample at
+ * head, each from the sample its delay before, or dark if there is none.
+ */
+LASERSHARK_HOT_INLINE void lasershark_get_delayed_colour(uint32_t head, uint32_t delays,
+		bool frame_mode, uint32_t *a, uint32_t *b, uint32_t *pins)
+{
+	uint32_t since, len, i;
+
+	if (frame_mode) {
+		since = head >= lasershark_frame_start ? head - lasershark_frame_start
+				: head + LASERSHARK_RINGBUFFER_SAMPLES - lasershark_frame_start;
+		len = lasershark_frame_end > lasershark_frame_start ? lasershark_frame_end
+				- lasershark_frame_start : lasershark_frame_end
+				+ LASERSHARK_RINGBUFFER_SAMPLES - lasershark_frame_start;
+	} else {
+		since = lasershark_delay_played;
+		len = 0;
+		if (since < LASERSHARK_DELAY_MAX) {
+			lasershark_delay_played = since + 1;
+		}
+	}
+
+	*a = DAC124S085_DAC_VAL_MIN;
+	i = lasershark_delayed_index(head, delays & 0xFF, since, len);
+	if (i != LASERSHARK_RINGBUFFER_SAMPLES) {
+		*a = (lasershark_ringbuffer_xya[i] >> LASERSHARK_XYA_A_SHIFT
+				& LASERSHARK_XYA_A_MASK) | (lasershark_ringbuffer_ab_low[i]
+				& LASERSHARK_AB_LOW_MASK);
+	}
+	*b = DAC124S085_DAC_VAL_MIN;
+	i = lasershark_delayed_index(head, delays >> 8 & 0xFF, since, len);
+	if (i != LASERSHARK_RINGBUFFER_SAMPLES) {
+		*b = lasershark_ringbuffer_b[i] << LASERSHARK_B_SHIFT
+				| lasershark_ringbuffer_ab_low[i] >> LASERSHARK_AB_LOW_B_SHIFT;
+	}
+	*pins = 0;
+	i = lasershark_delayed_index(head, delays >> 16 & 0xFF, since, len);
+	if (i != LASERSHARK_RINGBUFFER_SAMPLES) {
+		*pins = lasershark_ringbuffer_pins[i / 4] >> ((i % 4) * 2) & 1; // C
+	}
+	i = lasershark_delayed_index(head, delays >> 24, since, len);
+	if (i != LASERSHARK_RINGBUFFER_SAMPLES) {
+		*pins |= lasershark_ringbuffer_pins[i / 4] >> ((i % 4) * 2) & 2; // INTL_A
+	}
+}
+
+// Plays the next sample, or blanks the output if there is none to play.
+LASERSHARK_HOT_INLINE void lasershark_output_sample(void) {
+	uint32_t latency = LPC_CT32B1->TC; // TC restarts from 0 on the match
     uint32_t temp = (lasershark_ringbuffer_head + 1)
 					% LASERSHARK_RINGBUFFER_SAMPLES;
+	uint32_t empty, queued;
+	bool frame_mode;
+
+	if (latency > lasershark_stats.isr_latency_max) {
+		lasershark_stats.isr_latency_max = latency;
+	}
+
+#if (LASERSHARK_DAC_TIMED_UPDATE)
+	// Draw the point preloaded last time at the same time after every tick.
+	while (LPC_CT32B1->TC < LASERSHARK_DAC_UPDATE_CLOCKS);
+	dac124s085_dac_update(lasershark_dac_update_frame);
+	lasershark_set_pins(lasershark_dac_update_pins);
+	if (lasershark_dac_update_rate) {
+		lasershark_set_ilda_rate(lasershark_dac_update_rate);
+		lasershark_dac_update_rate = 0;
+	}
+#endif
 
 	if (!lasershark_output_enabled /*|| !lasershark_get_interlock_b()*/) {
 		// This is buffer sent when the system is off
-		lasershark_blankingbuffer[0] = DAC124S085_DAC_VAL_MIN; // A
-		lasershark_blankingbuffer[1] = DAC124S085_DAC_VAL_MIN; // B
-		lasershark_blankingbuffer[2] = DAC124S085_INPUT_REG_DATA_MASK
-				& DAC124S085_DAC_VAL_MID; // INTL_A, C, X
-		lasershark_blankingbuffer[3] = DAC124S085_DAC_VAL_MID; // Y
-
-		lasershark_set_interlock_a(false);
-		dac124s085_dac(lasershark_blankingbuffer);
-		lasershark_set_c(false);
+		lasershark_output_frames(lasershark_blankingbuffer, 0);
+		lasershark_delay_played = 0;
+		lasershark_blank = false;
 		return;
 	}
 
+	while (lasershark_control_head != lasershark_control_tail
+			&& lasershark_controls[lasershark_control_head].index
+					== lasershark_ringbuffer_head) {
+		lasershark_apply_control(&lasershark_controls[lasershark_control_head]);
+		lasershark_control_head = (lasershark_control_head + 1)
+				% LASERSHARK_CONTROL_QUEUE_SIZE;
+	}
+
+	frame_mode = lasershark_frame_mode;
+	if (frame_mode) {
+		// Play the front frame round and round, swapping the back one in
+		// between passes.
+		if (!lasershark_frame_playing) {
+			if (!lasershark_frame_swap) {
+				lasershark_output_dark();
+				return;
+			}
+			lasershark_take_frame();
+			lasershark_ringbuffer_head = lasershark_frame_start;
+			temp = (lasershark_frame_start + 1) % LASERSHARK_RINGBUFFER_SAMPLES;
+		}
+		if (temp == lasershark_frame_end) {
+			if (lasershark_frame_swap) {
+				lasershark_take_frame();
+			}
+			temp = lasershark_frame_start;
+			lasershark_frame_passes++;
+		}
 	// If the head and tail are the same, don't play the sample, it can make the galvos/lasers lose sanity.
 	// This also has the desirable side effect of turning off the laser once all the buffer samples are used up (i.e. in the even USB comms stop).
-	if (temp == lasershark_ringbuffer_tail) {
-		lasershark_set_interlock_a(false);
-		dac124s085_dac_chn_set(LASERSHARK_A_DAC_REG, DAC124S085_DAC_VAL_MIN,
-				false);
-		dac124s085_dac_chn_set(LASERSHARK_B_DAC_REG, DAC124S085_DAC_VAL_MIN,
-				true);
-		lasershark_set_c(false);
+	} else if (temp == lasershark_ringbuffer_tail) {
+		lasershark_output_dark();
+		lasershark_delay_played = 0;
+		lasershark_blank = false;
 
+		lasershark_stats.underrun_samples++;
+		if (!lasershark_underrun) {
+			lasershark_underrun = true;
+			lasershark_stats.underrun_events++;
+			lasershark_stats.underrun_frame = LPC_USB->INFO
+					& LASERSHARK_USB_FRAME_NR_MASK;
+			lasershark_stats.low_water = 0;
+		}
 		return;
 	}
 
-	lasershark_set_interlock_a(
-			lasershark_ringbuffer[lasershark_ringbuffer_head][0]
-					& LASERSHARK_INTL_A_BITMASK);
-	dac124s085_dac(lasershark_ringbuffer[lasershark_ringbuffer_head]);
-	lasershark_set_c(
-			lasershark_ringbuffer[lasershark_ringbuffer_head][0]
-					& LASERSHARK_C_BITMASK);
+	uint32_t head = lasershark_ringbuffer_head;
+	uint32_t xya = lasershark_ringbuffer_xya[head];
+	uint32_t delays = lasershark_delays;
+	uint32_t a, b, pins;
 
+	if (delays) {
+		lasershark_get_delayed_colour(head, delays, frame_mode, &a, &b, &pins);
+	} else {
+		uint32_t ab_low = lasershark_ringbuffer_ab_low[head];
+
+		a = (xya >> LASERSHARK_XYA_A_SHIFT & LASERSHARK_XYA_A_MASK) | (ab_low
+				& LASERSHARK_AB_LOW_MASK);
+		b = lasershark_ringbuffer_b[head] << LASERSHARK_B_SHIFT | ab_low
+				>> LASERSHARK_AB_LOW_B_SHIFT;
+		pins = lasershark_ringbuffer_pins[head / 4] >> ((head % 4) * 2) & 3;
+	}
+	if (lasershark_blank) {
+		a = b = DAC124S085_DAC_VAL_MIN;
+		pins = 0;
+	}
+	lasershark_output_values(a, b, xya & DAC124S085_INPUT_REG_DATA_MASK, xya
+			>> LASERSHARK_XYA_Y_SHIFT & DAC124S085_INPUT_REG_DATA_MASK, pins);
 	lasershark_ringbuffer_head = temp;
+	lasershark_underrun = false;
+	if (frame_mode) {
+		return;
+	}
+
+	empty = lasershark_get_free_sample_count();
+	queued = LASERSHARK_RINGBUFFER_SAMPLES - 1 - empty;
+	if (queued < lasershark_stats.low_water) {
+		lasershark_stats.low_water = queued;
+	}
+
+#if (LASERSHARK_USB_DATA_NAK)
+	// A held back data packet fits now; have the USB interrupt read it.
+	if (lasershark_ringbuffer_room_wanted && empty
+			> lasershark_ringbuffer_room_wanted + lasershark_ringbuffer_reserved) {
+		lasershark_ringbuffer_room_wanted = 0;
+		NVIC_SetPendingIRQ(USB_IRQ_IRQn);
+	}
+#endif
 }
 
+/*
+ * Counts the sample period that just ended, which MR0 held as ended, and sets
+ * the next one, a clock longer whenever the fractions of a clock have added up
+ * to a whole one.
+ */
+LASERSHARK_HOT_INLINE void lasershark_next_period(uint32_t ended) {
+	uint32_t acc = lasershark_core_duration_acc + lasershark_core_duration_frac;
+
+	lasershark_core_clocks += ended + 1;
+	LPC_CT32B1->MR0 = lasershark_core_duration + (acc
+			< lasershark_core_duration_acc);
+	lasershark_core_duration_acc = acc;
+}
+
+LASERSHARK_HOT_PATH void CT32B1_IRQHandler(void) {
+	uint32_t ended = LPC_CT32B1->MR0; // Before a control word changes the rate
+	PROFILE_START(start);
+
+	LPC_CT32B1->IR = 1; /* clear interrupt flag */
+	lasershark_output_sample();
+	lasershark_next_period(ended);
+	PROFILE_END(PROFILE_CT32B1_IRQ, start);
+}
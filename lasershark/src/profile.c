@@ -0,0 +1,99 @@
+/*
+profile.c - Lasershark firmware.
+Copyright (C) 2012 Jeffrey Nelson <nelsonjm@macpod.net>
+
+This file is part of Lasershark's Firmware.
+
+Lasershark is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+Lasershark is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Lasershark. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <string.h>
+#include "profile.h"
+
+#if (PROFILE_ENABLED)
+
+struct profile_point {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t buckets[PROFILE_BUCKETS];
+};
+
+static volatile struct profile_point profile_points[PROFILE_POINTS];
+
+void profile_init(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	profile_clear();
+}
+
+void profile_clear(void) {
+	uint32_t i, j;
+
+	for (i = 0; i < PROFILE_POINTS; i++) {
+		profile_points[i].count = 0;
+		profile_points[i].min = UINT32_MAX;
+		profile_points[i].max = 0;
+		profile_points[i].sum = 0;
+		for (j = 0; j < PROFILE_BUCKETS; j++) {
+			profile_points[i].buckets[j] = 0;
+		}
+	}
+}
+
+void profile_record(uint32_t point, uint32_t cycles) {
+	volatile struct profile_point *p = &profile_points[point];
+	uint32_t bucket = 32 - __CLZ(cycles >> PROFILE_BUCKET0_SHIFT);
+
+	if (bucket >= PROFILE_BUCKETS) {
+		bucket = PROFILE_BUCKETS - 1;
+	}
+	p->count++;
+	p->sum += cycles;
+	if (cycles < p->min) {
+		p->min = cycles;
+	}
+	if (cycles > p->max) {
+		p->max = cycles;
+	}
+	p->buckets[bucket]++;
+}
+
+/*
+ * Writes PROFILE_REPORT_SIZE bytes about a point to report. Returns false if
+ * there is no such point.
+ */
+bool profile_get(uint32_t point, uint8_t *report) {
+	uint32_t i, values[4 + PROFILE_BUCKETS];
+	volatile struct profile_point *p;
+
+	if (point >= PROFILE_POINTS) {
+		return false;
+	}
+	p = &profile_points[point];
+	values[0] = p->count;
+	values[1] = p->count ? p->min : 0;
+	values[2] = p->max;
+	values[3] = p->count ? p->sum / p->count : 0;
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		values[4 + i] = p->buckets[i];
+	}
+	memcpy(report, values, sizeof(values));
+	return true;
+}
+
+#endif
@@ -101,8 +101,10 @@ void SSPInit(void) {
 	GPIOSetValue( PORT0, 2, 1 );
 #endif
 
-	// dss=16bit, frame format = spi, CPOL = 0, cpha = 0, SCR is 0
-	LPC_SSP0->CR0 = 0xF << 0 | 0x0 << 4 | 0 << 6 | 1 << 7 | 0x00 << 8;
+	// dss=16bit, frame format = spi, CPOL = 1, cpha = 0, SCR is 0
+	// With cpha = 0 SSEL is pulsed between back to back frames, which the DAC
+	// needs to latch each word when several are queued in the TX FIFO.
+	LPC_SSP0->CR0 = 0xF << 0 | 0x0 << 4 | 1 << 6 | 0 << 7 | 0x00 << 8;
 	/* SSPCPSR clock prescale register, master mode, minimum divisor is 0x02 */
 	LPC_SSP0->CPSR = 0x2; /* CPSDVSR */
 
@@ -133,8 +135,9 @@ void SSPInit(void) {
 #endif
 #endif
 	/* Set SSPINMS registers to enable interrupts */
-	/* enable all error related interrupts */
-	LPC_SSP0->IMSC = SSPIMSC_RORIM | SSPIMSC_RTIM;
+	/* enable the receive overrun interrupt. The receive timeout interrupt is
+	 left off as SSPSendC16Queued() leaves frames in the RxFIFO on purpose. */
+	LPC_SSP0->IMSC = SSPIMSC_RORIM;
 	return;
 }
 
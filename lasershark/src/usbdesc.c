@@ -52,7 +52,7 @@ const uint8_t USB_ConfigDescriptor[] = {
   WBVAL(                             /* wTotalLength */
     1*USB_CONFIGUARTION_DESC_SIZE +
     3*USB_INTERFACE_DESC_SIZE     +  /* interfaces */
-    4*USB_ENDPOINT_DESC_SIZE         /* endpoints */
+    5*USB_ENDPOINT_DESC_SIZE         /* endpoints */
       ),
   0x02,                              /* bNumInterfaces */
   0x01,                              /* bConfigurationValue: 0x01 is used to select this configuration */
@@ -67,7 +67,7 @@ const uint8_t USB_ConfigDescriptor[] = {
   USB_INTERFACE_DESCRIPTOR_TYPE,     /* bDescriptorType */
   0,			                     /* bInterfaceNumber: Number of Interface */
   0x00,                              /* bAlternateSetting: Alternate setting */
-  0x02,                              /* bNumEndpoints: Two endpoints used */
+  0x03,                              /* bNumEndpoints: Three endpoints used */
   0xFF, 							 /* bInterfaceClass: Vendor specific */
   0xFF,						         /* bInterfaceSubClass: Vendor specific */
   0x00,                              /* bInterfaceProtocol: no protocol used */
@@ -89,6 +89,14 @@ const uint8_t USB_ConfigDescriptor[] = {
   WBVAL(LASERSHARK_USB_CTRL_SIZE),            			 /* wMaxPacketSize */
   0x00,                              /* bInterval: ignore for Bulk transfer */
 
+  /* Endpoint, EP2 Interrupt In */
+  USB_ENDPOINT_DESC_SIZE,            /* bLength */
+  USB_ENDPOINT_DESCRIPTOR_TYPE,      /* bDescriptorType */
+  USB_ENDPOINT_IN(2),                /* bEndpointAddress */
+  USB_ENDPOINT_TYPE_INTERRUPT,       /* bmAttributes */
+  WBVAL(LASERSHARK_USB_STATUS_SIZE), /* wMaxPacketSize */
+  LASERSHARK_STATUS_FRAMES,          /* bInterval: polled every this many frames */
+
 /* Interface 1, Alternate Setting 0, Data class interface descriptor*/
   USB_INTERFACE_DESC_SIZE,           /* bLength */
   USB_INTERFACE_DESCRIPTOR_TYPE,     /* bDescriptorType */
@@ -190,7 +198,7 @@ uint8_t USB_StringDescriptor[] = {
 
 
 void usb_populate_serialno() {
-	int i, j, temp;
+	int i, j, temp, chars;
 	unsigned int result_table[5];
 
 	uint8_t* curr_stringdescriptor_ptr = USB_StringDescriptor
@@ -206,6 +214,7 @@ void usb_populate_serialno() {
 	if (*curr_stringdescriptor_ptr < 16 * 2) { // Verify the length to make sure we have enough room to write the SN
 		return;
 	}
+	chars = (*curr_stringdescriptor_ptr - 2) / 2;
 
 	curr_stringdescriptor_ptr++;
 	if (*curr_stringdescriptor_ptr != USB_STRING_DESCRIPTOR_TYPE) { // Verify this is a a string descriptor.
@@ -218,7 +227,9 @@ void usb_populate_serialno() {
 	}
 
 	curr_stringdescriptor_ptr++; // We are on the first string char.
-	for (i = 0; i < 4; i++) {
+	// Write as many whole UID words as the descriptor has chars for.
+	for (i = 0; i < 4 && chars >= (int) sizeof(unsigned) * 2; i++) {
+		chars -= sizeof(unsigned) * 2;
 		for (j = 0; j < sizeof(unsigned) * 2; j++) {
 			temp = (uint8_t) (result_table[1 + i] >> (4 * j)) & 0x0F;
 			if (temp < 10) {
@@ -4,13 +4,18 @@
 #include "mw_usbd_desc.h"
 #include "power_api.h"
 #include "usbuser.h"
+#include "profile.h"
 
 USBD_API_T* pUsbApi;
 USBD_HANDLE_T hUsb;
 
 void USB_IRQHandler(void)
 {
+  PROFILE_START(start);
+
   pUsbApi->hw->ISR(hUsb);
+  USB_ResumeData();
+  PROFILE_END(PROFILE_USB_IRQ, start);
 }
 
 /*
@@ -56,6 +61,9 @@ void USB_Init (void) {
   usb_param.mem_base = 0x10000800;
   usb_param.mem_size = 0x00001000;
   usb_param.max_num_ep = 5;
+  usb_param.USB_SOF_Event = USB_SOF_Event;
+  usb_param.USB_Configure_Event = USB_Configure_Event;
+  usb_param.USB_Interface_Event = USB_Interface_Event;
 
   /* Initialize Descriptor pointers */
   memset((void*)&desc, 0, sizeof(USB_CORE_DESCS_T));
@@ -25,12 +25,177 @@
 #include "lasershark.h"
 #include "gpio.h"
 #include "config.h"
+#include "profile.h"
 
 ErrorCode_t USB_EndPoint1(USBD_HANDLE_T hUsb, void* data, uint32_t event);
 ErrorCode_t USB_EndPoint2(USBD_HANDLE_T hUsb, void* data, uint32_t event);
 ErrorCode_t USB_EndPoint3(USBD_HANDLE_T hUsb, void* data, uint32_t event);
 ErrorCode_t USB_EndPoint4(USBD_HANDLE_T hUsb, void* data, uint32_t event);
 
+// Holds a data packet between ReadEP() and lasershark_process_data(), which
+// reads it a word at a time. The bulk and isochronous endpoints are only
+// serviced from the USB interrupt, so they can share it.
+static unsigned char DataPacket[LASERSHARK_USB_DATA_ISO_SIZE] __attribute__((aligned(4)));
+
+// The status record being pushed on endpoint 2, whether the host has yet to
+// collect it, whether the endpoint is configured and frames until the next.
+static struct lasershark_status StatusRecord;
+static volatile bool StatusBusy;
+static bool StatusEnabled;
+static uint32_t StatusCountdown;
+
+#if (LASERSHARK_USB_DATA_NAK)
+// Bulk data endpoint whose packet is left unread until the ring buffer has room, 0 if none.
+static volatile uint32_t HeldDataEP;
+// Where the part of a compressed bulk packet that did not fit yet starts in
+// DataPacket, and how long it is.
+static uint32_t DataOffset, DataLeft;
+
+/*
+ * Has USB_ResumeData() carry on with held data: after this interrupt if the
+ * ring buffer has room for a packet, which it may while the output is off,
+ * else once the timer interrupt has played enough samples to make it.
+ */
+static void USB_WaitForRoom(void) {
+	if (lasershark_get_empty_sample_count() > LASERSHARK_USB_DATA_BULK_SIZE
+			/ (LASERSHARK_ILDA_CHANNELS * sizeof(uint16_t))) {
+		NVIC_SetPendingIRQ(USB_IRQ_IRQn);
+		return;
+	}
+	lasershark_ringbuffer_room_wanted = LASERSHARK_USB_DATA_BULK_SIZE
+			/ (LASERSHARK_ILDA_CHANNELS * sizeof(uint16_t));
+}
+
+/*
+ * Decodes what it can of the rest of a compressed bulk packet, which is at
+ * most LASERSHARK_DECODE_SAMPLES_MAX samples. A frame being loaded is not
+ * played out to make room, so that is decoded to the end.
+ */
+static void USB_DecodeData(void) {
+	uint32_t used = lasershark_decode_data(DataPacket + DataOffset, DataLeft,
+			!lasershark_frame_mode);
+
+	DataOffset += used;
+	DataLeft -= used;
+	if (DataLeft) {
+		USB_WaitForRoom();
+	}
+}
+#endif
+
+// Reads a data packet and packs its samples into the ring buffer.
+static void USB_ReadData(USBD_HANDLE_T hUsb, uint32_t EPNum) {
+	uint32_t cnt = pUsbApi->hw->ReadEP(hUsb, EPNum, DataPacket);
+
+	if (lasershark_data_format == LASERSHARK_DATA_RAW) {
+		lasershark_process_data(DataPacket, cnt);
+		return;
+	}
+#if (LASERSHARK_USB_DATA_NAK)
+	// A compressed bulk packet is held back in part if it does not all fit.
+	if (EPNum == USB_ENDPOINT_OUT(3)) {
+		DataOffset = 0;
+		DataLeft = cnt;
+		USB_DecodeData();
+		return;
+	}
+#endif
+	lasershark_decode_data(DataPacket, cnt, false);
+}
+
+/*
+ * Drops the rest of a compressed bulk packet that did not all fit. It was
+ * decoded with state that a change of data format resets.
+ */
+void USB_DropData(void) {
+#if (LASERSHARK_USB_DATA_NAK)
+	DataOffset = 0;
+	DataLeft = 0;
+#endif
+}
+
+// Forgets held data along with the packet held back behind it, whose endpoint has been reset.
+static void USB_ResetData(void) {
+#if (LASERSHARK_USB_DATA_NAK)
+	USB_DropData();
+	HeldDataEP = 0;
+	lasershark_ringbuffer_room_wanted = 0;
+#endif
+}
+
+/*
+ * Reads a bulk data packet held back by USB_EndPoint3(), after finishing the
+ * one before if it was compressed and did not all fit, once the ring buffer
+ * has room for it. Called after every USB interrupt.
+ */
+void USB_ResumeData(void) {
+#if (LASERSHARK_USB_DATA_NAK)
+	uint32_t ep = HeldDataEP;
+
+	if (lasershark_ringbuffer_room_wanted) {
+		return;
+	}
+	if (DataLeft) {
+		USB_DecodeData();
+		if (DataLeft) {
+			return;
+		}
+	}
+	if (ep) {
+		HeldDataEP = 0;
+		USB_ReadData(hUsb, ep);
+	}
+#endif
+}
+
+// Writes a fresh status record to endpoint 2 every LASERSHARK_STATUS_FRAMES frames.
+static void USB_PushStatus(USBD_HANDLE_T hUsb) {
+	if (StatusCountdown) {
+		StatusCountdown--;
+		return;
+	}
+	if (!StatusEnabled || StatusBusy) {
+		return;
+	}
+	StatusCountdown = LASERSHARK_STATUS_FRAMES - 1;
+	lasershark_get_status(&StatusRecord);
+	StatusBusy = true;
+	pUsbApi->hw->WriteEP(hUsb, USB_ENDPOINT_IN(2), (uint8_t *) &StatusRecord,
+			sizeof(StatusRecord));
+}
+
+// Called by the ROM stack on every start of frame.
+ErrorCode_t USB_SOF_Event(USBD_HANDLE_T hUsb) {
+	lasershark_usb_sof();
+	USB_PushStatus(hUsb);
+	return LPC_OK;
+}
+
+/*
+ * Called by the ROM stack when the host sets the configuration, which resets
+ * the endpoints and with them any status record not yet collected and any
+ * data held back.
+ */
+ErrorCode_t USB_Configure_Event(USBD_HANDLE_T hUsb) {
+	USB_CORE_CTRL_T *pCtrl = (USB_CORE_CTRL_T *) hUsb;
+
+	StatusEnabled = pCtrl->config_value != 0;
+	StatusBusy = false;
+	USB_ResetData();
+	return LPC_OK;
+}
+
+/*
+ * Called by the ROM stack when the host picks an alternate setting of
+ * interface 1, which swaps the bulk endpoint 3 for the isochronous endpoint 4
+ * or back. Data held back from endpoint 3 goes with it; endpoint 4 packets
+ * are read into DataPacket, over what was left of it.
+ */
+ErrorCode_t USB_Interface_Event(USBD_HANDLE_T hUsb) {
+	USB_ResetData();
+	return LPC_OK;
+}
+
 ErrorCode_t USB_InitUser(void){
 	ErrorCode_t err;
 
@@ -42,7 +207,15 @@ ErrorCode_t USB_InitUser(void){
 	if(err != LPC_OK){
 		return err;
 	}
+	err = pUsbApi->core->RegisterEpHandler(hUsb, (2 << 1) + 1, USB_EndPoint2, NULL); // Endpoint 2 In
+	if(err != LPC_OK){
+		return err;
+	}
 	err = pUsbApi->core->RegisterEpHandler(hUsb, (3 << 1), USB_EndPoint3, NULL); // Endpiont 3 Out
+	if(err != LPC_OK){
+		return err;
+	}
+	err = pUsbApi->core->RegisterEpHandler(hUsb, (4 << 1), USB_EndPoint4, NULL); // Endpoint 4 Out
 
 	return err;
 }
@@ -70,10 +243,14 @@ ErrorCode_t USB_EndPoint1(USBD_HANDLE_T hUsb, void* data, uint32_t event) {
  *  USB Endpoint 2 Event Callback
  *   Called automatically on USB Endpoint 2 Event
  *    Parameter:       event
+ *
+ *  Endpoint 2 is an interrupt IN endpoint on interface 0 that the status
+ *  records written by USB_PushStatus() go out on.
  */
 ErrorCode_t USB_EndPoint2(USBD_HANDLE_T hUsb, void* data, uint32_t event) {
 	switch (event) {
-	case USB_EVT_IN:
+	case USB_EVT_IN: // The host has collected the status record
+		StatusBusy = false;
 		break;
 	}
 
@@ -86,16 +263,10 @@ ErrorCode_t USB_EndPoint2(USBD_HANDLE_T hUsb, void* data, uint32_t event) {
  *    Parameter:       event
  */
 ErrorCode_t USB_EndPoint3(USBD_HANDLE_T hUsb, void* data, uint32_t event) {
-	uint32_t cnt;
-	unsigned char packet[LASERSHARK_USB_DATA_BULK_SIZE*4];
+	PROFILE_START(start);
 
 	switch (event) {
 	case USB_EVT_OUT:
-		//while (1) {
-		//	if (LASERSHARK_USB_DATA_BULK_SIZE <= lasershark_get_empty_sample_count()) {
-		//		break;
-		//	}
-		//}
 		//LPC_USB->Ctrl = ((USB_ENDPOINT_OUT(3) & 0x0F) << 2) | CTRL_RD_EN; // enable read
 		// 3 clock cycles to fetch the packet length from RAM.
 		asm("nop");
@@ -103,19 +274,26 @@ ErrorCode_t USB_EndPoint3(USBD_HANDLE_T hUsb, void* data, uint32_t event) {
 		asm("nop");
 		asm("nop");
 		
+#if (LASERSHARK_USB_DATA_NAK)
+		// Not reading the packet leaves the endpoint buffer full, which NAKs the host.
+		// A frame being loaded takes what fits and drops the rest.
+		if (!lasershark_frame_mode && (DataLeft || lasershark_get_empty_sample_count()
+				<= LASERSHARK_USB_DATA_BULK_SIZE
+				/ (LASERSHARK_ILDA_CHANNELS * sizeof(uint16_t)))) {
+			HeldDataEP = USB_ENDPOINT_OUT(3);
+			USB_WaitForRoom();
+			break;
+		}
+#endif
 		//cnt = pUsbApi->hw->ReadEP(hUsb, USB_CDC_EP_BULK_OUT, pVcom->rxBuf);
-		cnt = pUsbApi->hw->ReadEP(hUsb, 3, packet);
+		USB_ReadData(hUsb, USB_ENDPOINT_OUT(3));
 
-		//if ((cnt = LPC_USB->RxPLen) & PKT_DV) { // We have data...
-		//	cnt &= PKT_LNGTH_MASK; // Get length in bytes
-			lasershark_process_data(packet, cnt);
-		//	LPC_USB->Ctrl = 0;
-		//}
 		//LPC_USB->Ctrl = 0; // Disable read mode.. do this if you ever want to see a USB packet again
 	    //WrCmdEP(USB_ENDPOINT_OUT(3), CMD_CLR_BUF);
 		break;
 	}
 
+	PROFILE_END(PROFILE_USB_EP3, start);
 	return LPC_OK;
 }
 
@@ -123,9 +301,20 @@ ErrorCode_t USB_EndPoint3(USBD_HANDLE_T hUsb, void* data, uint32_t event) {
  *  USB Endpoint 4 Event Callback
  *   Called automatically on USB Endpoint 4 Event
  *    Parameter:       event
+ *
+ *  Endpoint 4 is the isochronous alternative to endpoint 3 (interface 1,
+ *  alternate setting 0). The host sends one packet of up to
+ *  LASERSHARK_USB_DATA_ISO_SIZE bytes a frame, sized to what is played in a
+ *  frame at the current rate. USB_ReadData() reads it into DataPacket and packs
+ *  its samples into the ring buffer straight away. Isochronous packets cannot
+ *  be NAKed, so unlike endpoint 3 a packet is never held back: samples from a
+ *  host that gets ahead of the output are dropped and counted as overruns.
  */
 ErrorCode_t USB_EndPoint4(USBD_HANDLE_T hUsb, void* data, uint32_t event) {
 	switch (event) {
+	case USB_EVT_OUT:
+		USB_ReadData(hUsb, USB_ENDPOINT_OUT(4));
+		break;
 	case USB_EVT_IN:
 		break;
 	}